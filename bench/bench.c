@@ -0,0 +1,125 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "bench.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Every block starts with its size, padded so the rest stays aligned. */
+#define BENCH_HEADER 16
+
+struct bench_counts bench_counts;
+
+static void * bench_track(unsigned char * block, size_t size) {
+    if (!block)
+        return NULL;
+    memcpy(block, &size, sizeof(size));
+    bench_counts.live += size;
+    if (bench_counts.live > bench_counts.peak)
+        bench_counts.peak = bench_counts.live;
+    return block + BENCH_HEADER;
+}
+
+static size_t bench_size(void * ptr) {
+    size_t size;
+    memcpy(&size, (unsigned char *) ptr - BENCH_HEADER, sizeof(size));
+    return size;
+}
+
+void * bench_malloc(size_t size) {
+    bench_counts.allocs++;
+    return bench_track(malloc(size + BENCH_HEADER), size);
+}
+
+void * bench_calloc(size_t count, size_t size) {
+    bench_counts.allocs++;
+    return bench_track(calloc(1, count * size + BENCH_HEADER), count * size);
+}
+
+void * bench_realloc(void * ptr, size_t size) {
+    size_t old;
+    unsigned char * block;
+    if (!ptr)
+        return bench_malloc(size);
+    bench_counts.reallocs++;
+    old = bench_size(ptr);
+    block = realloc((unsigned char *) ptr - BENCH_HEADER, size + BENCH_HEADER);
+    if (!block)
+        return NULL;
+    bench_counts.live -= old;
+    return bench_track(block, size);
+}
+
+void bench_free(void * ptr) {
+    if (!ptr)
+        return;
+    bench_counts.frees++;
+    bench_counts.live -= bench_size(ptr);
+    free((unsigned char *) ptr - BENCH_HEADER);
+}
+
+void bench_peak_reset(void) {
+    bench_counts.peak = bench_counts.live;
+}
+
+unsigned bench_seed = 12345;
+
+unsigned bench_rand(unsigned n) {
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return (bench_seed >> 16) % n;
+}
+
+void bench_printf(struct bench_text * t, const char * format, ...) {
+    va_list args;
+    int n;
+    if (t->capacity - t->length < 256) {
+        t->capacity = t->capacity * 2 + 256;
+        t->data = realloc(t->data, t->capacity);
+    }
+    for (;;) {
+        va_start(args, format);
+        n = vsnprintf(t->data + t->length, t->capacity - t->length, format, args);
+        va_end(args);
+        if (n >= 0 && (size_t) n < t->capacity - t->length)
+            break;
+        t->capacity = t->capacity * 2 + (n > 0 ? n : 0) + 256;
+        t->data = realloc(t->data, t->capacity);
+    }
+    t->length += n;
+}
+
+void bench_puts(struct bench_text * t, const char * string) {
+    size_t length = strlen(string);
+    if (t->capacity - t->length < length + 1) {
+        t->capacity = t->capacity * 2 + length + 1;
+        t->data = realloc(t->data, t->capacity);
+    }
+    memcpy(t->data + t->length, string, length);
+    t->length += length;
+}
+
+double bench_now(void) {
+    return (double) clock() / CLOCKS_PER_SEC;
+}
@@ -0,0 +1,66 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef BKD_BENCH_
+#define BKD_BENCH_
+
+/* Counting allocator and helpers shared by the benchmarks. Benchmarks build
+ * the library with BKD_MALLOC and friends pointing here, so they can report
+ * how often it allocates and how much memory it holds at most. */
+
+#include <stddef.h>
+
+struct bench_counts {
+    unsigned long allocs;
+    unsigned long reallocs;
+    unsigned long frees;
+    size_t live;
+    size_t peak;
+};
+
+extern struct bench_counts bench_counts;
+
+void * bench_malloc(size_t size);
+void * bench_calloc(size_t count, size_t size);
+void * bench_realloc(void * ptr, size_t size);
+void bench_free(void * ptr);
+
+/* Starts measuring the peak from the memory in use now. */
+void bench_peak_reset(void);
+
+/* Small deterministic generator, so runs can be compared. */
+extern unsigned bench_seed;
+unsigned bench_rand(unsigned n);
+
+/* Growable text for generating input. */
+struct bench_text {
+    char * data;
+    size_t length;
+    size_t capacity;
+};
+
+void bench_printf(struct bench_text * t, const char * format, ...);
+void bench_puts(struct bench_text * t, const char * string);
+
+/* Processor time in seconds. */
+double bench_now(void);
+
+#endif /* end of include guard: BKD_BENCH_ */
@@ -0,0 +1,463 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * End to end benchmark. Generates corpora that stress different parts of the
+ * parser and renderer, then reports for bkd_parse and bkd_html separately the
+ * speed in MB of input per second, the number of allocations and reallocations,
+ * and the most memory held at once. Usage:
+ *
+ *     bench/corpus [-b baseline] [-w results] [-d dir] [-s MB] [corpus...]
+ *
+ * -b compares against results written earlier with -w. Speed depends on the
+ * machine and is only reported, but more allocations or memory than the
+ * baseline fail the run, since those are the same everywhere. -d writes the
+ * generated corpora to dir as .bkd files, so they can be fed to the command
+ * line tool. Results are one line per corpus and phase, with a header line
+ * starting with #, which is also the format of the baseline.
+ */
+
+#include "bench.h"
+#include "bkd.h"
+#include "bkd_html.h"
+#include "bkd_utf8.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+/* Relative change in memory held that counts as a regression. */
+#define CORPUS_MEMORY_TOLERANCE 0.05
+
+/* Relative loss of speed that is flagged, though it does not fail the run. */
+#define CORPUS_SPEED_TOLERANCE 0.10
+
+#define CORPUS_RUNS 5
+
+static const char * words[] = {
+    "the", "a", "document", "parser", "quickly", "renders", "markup", "into",
+    "plain", "html", "with", "lists", "and", "tables", "of", "text", "that",
+    "never", "needs", "escaping", "because", "every", "line", "is", "read",
+    "once", "while", "nodes", "are", "built", "from", "left", "to", "right",
+    "notes", "about", "memory", "speed", "input", "output", "bytes", "for"
+};
+
+#define WORDCOUNT (sizeof(words) / sizeof(*words))
+
+static void gen_sentence(struct bench_text * t, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        bench_puts(t, i ? " " : "");
+        bench_puts(t, words[bench_rand(WORDCOUNT)]);
+    }
+    bench_puts(t, bench_rand(8) ? "." : ",");
+}
+
+/* Paragraphs of wrapped lines, with a header now and then. */
+static void gen_prose(struct bench_text * t, size_t size) {
+    while (t->length < size) {
+        if (!bench_rand(10))
+            bench_printf(t, "%.*s %s %s\n\n", 1 + bench_rand(3), "###",
+                    words[bench_rand(WORDCOUNT)], words[bench_rand(WORDCOUNT)]);
+        for (uint32_t lines = 2 + bench_rand(8); lines; lines--) {
+            gen_sentence(t, 6 + bench_rand(10));
+            bench_puts(t, "\n");
+        }
+        bench_puts(t, "\n");
+    }
+}
+
+static void gen_list(struct bench_text * t, uint32_t depth, uint32_t items) {
+    char marker = bench_rand(2) ? '%' : '*';
+    for (uint32_t i = 0; i < items; i++) {
+        bench_printf(t, "%*s%c ", 2 * depth, "", marker);
+        gen_sentence(t, 2 + bench_rand(6));
+        bench_puts(t, "\n");
+        if (depth < 24 && bench_rand(10) < 4) {
+            bench_puts(t, "\n");
+            gen_list(t, depth + 1, 1 + bench_rand(4));
+            bench_puts(t, "\n");
+        }
+    }
+}
+
+/* Lists of % and * items, nested up to 24 deep. */
+static void gen_lists(struct bench_text * t, size_t size) {
+    while (t->length < size) {
+        gen_list(t, 0, 2 + bench_rand(6));
+        bench_puts(t, "\n");
+    }
+}
+
+/* Tables of a few hundred rows, some cells empty, some with markup. */
+static void gen_grids(struct bench_text * t, size_t size) {
+    while (t->length < size) {
+        uint32_t cols = 4 + bench_rand(28), rows = 100 + bench_rand(400);
+        for (uint32_t r = 0; r < rows; r++) {
+            for (uint32_t c = 0; c < cols; c++) {
+                switch (bench_rand(8)) {
+                    case 0: bench_puts(t, "|"); break;
+                    case 1: bench_printf(t, "| [B:%s] ", words[bench_rand(WORDCOUNT)]); break;
+                    default: bench_printf(t, "| %s %u ", words[bench_rand(WORDCOUNT)], bench_rand(1000)); break;
+                }
+            }
+            bench_puts(t, "|\n");
+        }
+        bench_puts(t, "\n");
+    }
+}
+
+static void gen_markup(struct bench_text * t, uint32_t depth) {
+    static const char * flags[] = {"B", "I", "BI", "C", "S", "U"};
+    const char * word = words[bench_rand(WORDCOUNT)];
+    switch (bench_rand(depth < 4 ? 8 : 6)) {
+        case 0: bench_printf(t, "[L:%s](https://example.com/%s)", word, word); break;
+        case 1: bench_printf(t, "[#:%s](section-%u)", word, bench_rand(100)); break;
+        case 2: bench_printf(t, "%s\\(263A)", word); break;
+        case 3: bench_printf(t, "%s\\n", word); break;
+        case 4: case 5: bench_printf(t, "[%s:%s]", flags[bench_rand(6)], word); break;
+        default:
+            bench_printf(t, "[%s:%s ", flags[bench_rand(6)], word);
+            gen_markup(t, depth + 1);
+            bench_puts(t, "]");
+            break;
+    }
+}
+
+/* Paragraphs where most words are marked up, some nested a few deep. */
+static void gen_inline(struct bench_text * t, size_t size) {
+    while (t->length < size) {
+        for (uint32_t lines = 1 + bench_rand(6); lines; lines--) {
+            for (uint32_t w = 4 + bench_rand(8); w; w--) {
+                if (bench_rand(4))
+                    gen_markup(t, 0);
+                else
+                    bench_puts(t, words[bench_rand(WORDCOUNT)]);
+                bench_puts(t, w > 1 ? " " : "\n");
+            }
+        }
+        bench_puts(t, "\n");
+    }
+}
+
+/* Code blocks of up to a few thousand lines, full of characters HTML escapes. */
+static void gen_code(struct bench_text * t, size_t size) {
+    static const char * code[] = {
+        "if (a < b && b > c) {",
+        "    return \"<tag>\" + x & 0xFF;",
+        "}",
+        "for (int i = 0; i < n; i++) sum += a[i] * b[i];",
+        "    printf(\"%d <= %d\\n\", x, y);",
+        "",
+        "x = [1, 2, 3] | map(f) | filter('odd');"
+    };
+    while (t->length < size) {
+        bench_puts(t, "```c\n");
+        for (uint32_t lines = 50 + bench_rand(2000); lines; lines--) {
+            bench_puts(t, code[bench_rand(sizeof(code) / sizeof(*code))]);
+            bench_puts(t, "\n");
+        }
+        bench_puts(t, "```\n\n");
+    }
+}
+
+static void put_codepoint(struct bench_text * t, uint32_t codepoint) {
+    char buffer[8];
+    buffer[bkd_utf8_write((uint8_t *) buffer, codepoint)] = '\0';
+    bench_puts(t, buffer);
+}
+
+/* Text in Chinese, Japanese and Korean scripts with emoji and a little ASCII. */
+static void gen_cjk(struct bench_text * t, size_t size) {
+    while (t->length < size) {
+        for (uint32_t lines = 2 + bench_rand(6); lines; lines--) {
+            for (uint32_t n = 20 + bench_rand(40); n; n--) {
+                switch (bench_rand(10)) {
+                    case 0: put_codepoint(t, 0x3041 + bench_rand(0x56)); break;
+                    case 1: put_codepoint(t, 0xAC00 + bench_rand(0x2BA4)); break;
+                    case 2: put_codepoint(t, 0x1F600 + bench_rand(0x50)); break;
+                    case 3: bench_puts(t, bench_rand(2) ? "\xE3\x80\x82" : " [B:abc] "); break;
+                    default: put_codepoint(t, 0x4E00 + bench_rand(0x5200)); break;
+                }
+            }
+            bench_puts(t, "\n");
+        }
+        bench_puts(t, "\n");
+    }
+}
+
+struct input {
+    struct bench_text text;
+    size_t * ends;
+    size_t count;
+};
+
+static void add_end(struct input * in) {
+    in->ends = realloc(in->ends, (in->count + 1) * sizeof(size_t));
+    in->ends[in->count++] = in->text.length;
+}
+
+/* Many separate documents of a couple hundred bytes, like comments or
+ * chat messages rendered one at a time. */
+static void gen_tiny(struct input * in, size_t size) {
+    struct bench_text * t = &in->text;
+    while (t->length < size) {
+        if (!bench_rand(3))
+            bench_printf(t, "## %s\n\n", words[bench_rand(WORDCOUNT)]);
+        gen_sentence(t, 4 + bench_rand(12));
+        bench_puts(t, " ");
+        gen_markup(t, 0);
+        bench_puts(t, "\n");
+        if (!bench_rand(3)) {
+            bench_puts(t, "\n* ");
+            gen_sentence(t, 3);
+            bench_puts(t, "\n* ");
+            gen_sentence(t, 3);
+            bench_puts(t, "\n");
+        }
+        bench_puts(t, "\n");
+        add_end(in);
+    }
+}
+
+struct corpus {
+    const char * name;
+    void (*gen)(struct bench_text * t, size_t size);
+};
+
+static const struct corpus corpora[] = {
+    {"prose", gen_prose},
+    {"lists", gen_lists},
+    {"grids", gen_grids},
+    {"inline", gen_inline},
+    {"code", gen_code},
+    {"cjk", gen_cjk},
+    {"tiny", NULL}
+};
+
+#define CORPUSCOUNT (sizeof(corpora) / sizeof(*corpora))
+
+static void generate(const struct corpus * c, size_t size, struct input * in) {
+    memset(in, 0, sizeof(*in));
+    bench_seed = 12345;
+    if (c->gen) {
+        c->gen(&in->text, size);
+        add_end(in);
+    } else {
+        gen_tiny(in, size);
+    }
+}
+
+/* Output stream that only counts what it is given. */
+static int sink_stream(struct bkd_ostream * self, const struct bkd_string data) {
+    *(size_t *) self->user += data.length;
+    return 0;
+}
+
+static struct bkd_ostreamdef sink_def = {sink_stream, NULL, NULL};
+
+struct result {
+    char corpus[32];
+    char phase[16];
+    size_t bytes;
+    double mbps;
+    unsigned long allocs;
+    unsigned long reallocs;
+    size_t peak;
+};
+
+/* Parses and renders every document of the input, best of a few runs. The
+ * counts come from the first run, as all runs allocate the same. */
+static void measure(const char * name, const struct input * in, struct result * parse, struct result * render) {
+    struct bkd_list ** docs = malloc(in->count * sizeof(*docs));
+    size_t outBytes = 0;
+    struct bkd_ostream sink = {&sink_def, &outBytes};
+    struct bench_counts before;
+    double parseBest = 0, renderBest = 0, t;
+    memset(parse, 0, sizeof(*parse));
+    memset(render, 0, sizeof(*render));
+    for (int run = 0; run < CORPUS_RUNS; run++) {
+        before = bench_counts;
+        bench_peak_reset();
+        t = bench_now();
+        for (size_t i = 0, start = 0; i < in->count; start = in->ends[i++])
+            docs[i] = bkd_parse_buffer((const uint8_t *) in->text.data + start, in->ends[i] - start);
+        t = bench_now() - t;
+        if (run == 0 || t < parseBest) parseBest = t;
+        if (run == 0) {
+            parse->allocs = bench_counts.allocs - before.allocs;
+            parse->reallocs = bench_counts.reallocs - before.reallocs;
+            parse->peak = bench_counts.peak - before.live;
+        }
+        before = bench_counts;
+        bench_peak_reset();
+        t = bench_now();
+        for (size_t i = 0; i < in->count; i++)
+            bkd_html(&sink, docs[i], 0, 0, NULL);
+        t = bench_now() - t;
+        if (run == 0 || t < renderBest) renderBest = t;
+        if (run == 0) {
+            render->allocs = bench_counts.allocs - before.allocs;
+            render->reallocs = bench_counts.reallocs - before.reallocs;
+            render->peak = bench_counts.peak - before.live;
+        }
+        for (size_t i = 0; i < in->count; i++)
+            bkd_docfree(docs[i]);
+    }
+    free(docs);
+    snprintf(parse->corpus, sizeof(parse->corpus), "%s", name);
+    snprintf(render->corpus, sizeof(render->corpus), "%s", name);
+    strcpy(parse->phase, "parse");
+    strcpy(render->phase, "html");
+    parse->bytes = render->bytes = in->text.length;
+    parse->mbps = in->text.length / 1e6 / parseBest;
+    render->mbps = in->text.length / 1e6 / renderBest;
+}
+
+static const char header[] = "# corpus phase bytes MB/s allocs reallocs peak\n";
+
+static void print_result(FILE * out, const struct result * r) {
+    fprintf(out, "%-8s %-6s %10zu %9.1f %10lu %10lu %12zu\n",
+            r->corpus, r->phase, r->bytes, r->mbps, r->allocs, r->reallocs, r->peak);
+}
+
+/* Reads results written with -w. Returns the number read. */
+static size_t read_results(const char * path, struct result ** results) {
+    FILE * f = fopen(path, "r");
+    char line[256];
+    struct result r;
+    size_t count = 0;
+    *results = NULL;
+    if (!f) {
+        fprintf(stderr, "corpus: cannot read %s\n", path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%31s %15s %zu %lf %lu %lu %zu",
+                    r.corpus, r.phase, &r.bytes, &r.mbps, &r.allocs, &r.reallocs, &r.peak) != 7)
+            continue;
+        *results = realloc(*results, (count + 1) * sizeof(r));
+        (*results)[count++] = r;
+    }
+    fclose(f);
+    return count;
+}
+
+/* Prints how a result compares to the baseline. Returns 1 if it allocates
+ * more often or holds more memory. */
+static int compare(const struct result * r, const struct result * base, size_t baseCount) {
+    const struct result * b = NULL;
+    int worse;
+    for (size_t i = 0; i < baseCount; i++)
+        if (!strcmp(base[i].corpus, r->corpus) && !strcmp(base[i].phase, r->phase))
+            b = base + i;
+    if (!b) {
+        printf("# %-8s %-6s not in baseline\n", r->corpus, r->phase);
+        return 0;
+    }
+    worse = r->allocs + r->reallocs > b->allocs + b->reallocs ||
+        r->peak > b->peak * (1 + CORPUS_MEMORY_TOLERANCE);
+    printf("# %-8s %-6s speed %+6.1f%%  allocs %+8ld  peak %+6.1f%%%s%s\n",
+            r->corpus, r->phase,
+            100 * (r->mbps / b->mbps - 1),
+            (long) (r->allocs + r->reallocs) - (long) (b->allocs + b->reallocs),
+            b->peak ? 100 * ((double) r->peak / b->peak - 1) : 0.0,
+            r->mbps < b->mbps * (1 - CORPUS_SPEED_TOLERANCE) ? "  slower" : "",
+            worse ? "  REGRESSION" : "");
+    return worse;
+}
+
+static void dump(const char * dir, const char * name, const struct input * in) {
+    char path[1024];
+    FILE * f;
+    snprintf(path, sizeof(path), "%s/%s.bkd", dir, name);
+    if (!(f = fopen(path, "wb"))) {
+        fprintf(stderr, "corpus: cannot write %s\n", path);
+        return;
+    }
+    fwrite(in->text.data, 1, in->text.length, f);
+    fclose(f);
+}
+
+static int selected(const char * name, char ** names, int count) {
+    if (!count) return 1;
+    for (int i = 0; i < count; i++)
+        if (!strcmp(names[i], name))
+            return 1;
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    const char * baselinePath = NULL, * writePath = NULL, * dumpDir = NULL;
+    struct result * baseline = NULL, * results = NULL;
+    size_t baseCount = 0, resultCount = 0, size = 4 * 1000 * 1000;
+    struct rusage usage;
+    struct input in;
+    int argi, regressions = 0;
+    FILE * out;
+    for (argi = 1; argi + 1 < argc && argv[argi][0] == '-'; argi += 2) {
+        switch (argv[argi][1]) {
+            case 'b': baselinePath = argv[argi + 1]; break;
+            case 'w': writePath = argv[argi + 1]; break;
+            case 'd': dumpDir = argv[argi + 1]; break;
+            case 's': size = (size_t) (atof(argv[argi + 1]) * 1e6); break;
+            default:
+                fprintf(stderr, "usage: %s [-b baseline] [-w results] [-d dir] [-s MB] [corpus...]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (baselinePath)
+        baseCount = read_results(baselinePath, &baseline);
+    results = malloc(2 * CORPUSCOUNT * sizeof(*results));
+    fputs(header, stdout);
+    for (size_t c = 0; c < CORPUSCOUNT; c++) {
+        if (!selected(corpora[c].name, argv + argi, argc - argi))
+            continue;
+        generate(corpora + c, size, &in);
+        if (dumpDir)
+            dump(dumpDir, corpora[c].name, &in);
+        measure(corpora[c].name, &in, results + resultCount, results + resultCount + 1);
+        print_result(stdout, results + resultCount);
+        print_result(stdout, results + resultCount + 1);
+        fflush(stdout);
+        resultCount += 2;
+        free(in.text.data);
+        free(in.ends);
+    }
+    getrusage(RUSAGE_SELF, &usage);
+    printf("# maxrss %ld kB\n", usage.ru_maxrss);
+    for (size_t i = 0; baseCount && i < resultCount; i++)
+        regressions += compare(results + i, baseline, baseCount);
+    if (writePath) {
+        if ((out = fopen(writePath, "w"))) {
+            fputs(header, out);
+            for (size_t i = 0; i < resultCount; i++)
+                print_result(out, results + i);
+            fclose(out);
+        } else {
+            fprintf(stderr, "corpus: cannot write %s\n", writePath);
+        }
+    }
+    free(results);
+    free(baseline);
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,631 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Microbenchmarks for the UTF-8, string and scanning kernels. Each kernel
+ * runs over inputs of several sizes and character mixes, next to a plain
+ * scalar version of the same function, and both write what they find to an
+ * output buffer. The report gives ns per input byte with its standard
+ * deviation for both, and fails if the outputs differ, so a faster version
+ * of any of these can be checked for speed and for identical output at once.
+ * Usage:
+ *
+ *     bench/kernels [kernel...]
+ *
+ * The static kernels of the parser and renderer are reached by building
+ * their sources into this file. Inputs are valid UTF-8, as the parser
+ * repairs anything else before these kernels see it.
+ */
+
+#include "bkd_parse.c"
+#include "bkd_html.c"
+
+#include "bench.h"
+#include "bkd_scan.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KERNEL_SAMPLES 9
+
+/* Each sample repeats a kernel until it has run at least this long. */
+#define KERNEL_MINTIME 0.002
+
+/* Output room the HTML escaper gets at a time, as in the renderer. */
+#define KERNEL_HTMLCHUNK 4096
+
+static const uint32_t sizes[] = {64, 1024, 16 * 1024, 256 * 1024};
+
+#define SIZECOUNT (sizeof(sizes) / sizeof(*sizes))
+
+struct input {
+    struct bkd_string text;
+    uint32_t * codepoints;
+    uint32_t codepointCount;
+};
+
+/* Steps through the input a line at a time. */
+static int next_line(const struct input * in, uint32_t * pos, struct bkd_string * line) {
+    const uint8_t * nl;
+    if (*pos >= in->text.length)
+        return 0;
+    line->data = in->text.data + *pos;
+    nl = memchr(line->data, '\n', in->text.length - *pos);
+    line->length = nl ? (uint32_t) (nl - line->data) : in->text.length - *pos;
+    *pos += line->length + 1;
+    return 1;
+}
+
+static uint8_t * put32(uint8_t * out, uint32_t value) {
+    memcpy(out, &value, 4);
+    return out + 4;
+}
+
+/* UTF-8 */
+
+static size_t utf8_read_lib(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    uint32_t pos = 0, codepoint;
+    while (pos < in->text.length) {
+        pos += bkd_utf8_read(in->text.data + pos, &codepoint);
+        o = put32(o, codepoint);
+    }
+    return o - out;
+}
+
+static size_t utf8_readlen_lib(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    uint32_t pos = 0, codepoint;
+    while (pos < in->text.length) {
+        pos += bkd_utf8_readlen(in->text.data + pos, &codepoint, in->text.length - pos);
+        o = put32(o, codepoint);
+    }
+    return o - out;
+}
+
+/* Decodes without checking anything, which is enough for valid input. The
+ * library also has to turn malformed sequences into U+FFFD. */
+static size_t utf8_read_ref(const struct input * in, uint8_t * out) {
+    const uint8_t * s = in->text.data, * end = s + in->text.length;
+    uint8_t * o = out;
+    uint32_t codepoint;
+    while (s < end) {
+        if (s[0] < 0x80) {
+            codepoint = *s++;
+        } else if (s[0] < 0xE0) {
+            codepoint = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+            s += 2;
+        } else if (s[0] < 0xF0) {
+            codepoint = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+            s += 3;
+        } else {
+            codepoint = ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+            s += 4;
+        }
+        o = put32(o, codepoint);
+    }
+    return o - out;
+}
+
+static size_t utf8_write_lib(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    for (uint32_t i = 0; i < in->codepointCount; i++)
+        o += bkd_utf8_write(o, in->codepoints[i]);
+    return o - out;
+}
+
+static size_t utf8_write_ref(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    uint32_t c;
+    for (uint32_t i = 0; i < in->codepointCount; i++) {
+        c = in->codepoints[i];
+        if (c < 0x80) {
+            *o++ = c;
+        } else if (c < 0x800) {
+            *o++ = 0xC0 | (c >> 6);
+            *o++ = 0x80 | (c & 0x3F);
+        } else if (c < 0x10000) {
+            *o++ = 0xE0 | (c >> 12);
+            *o++ = 0x80 | ((c >> 6) & 0x3F);
+            *o++ = 0x80 | (c & 0x3F);
+        } else {
+            *o++ = 0xF0 | (c >> 18);
+            *o++ = 0x80 | ((c >> 12) & 0x3F);
+            *o++ = 0x80 | ((c >> 6) & 0x3F);
+            *o++ = 0x80 | (c & 0x3F);
+        }
+    }
+    return o - out;
+}
+
+/* Whitespace, line by line */
+
+static int ref_space(uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static size_t strindent_lib(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line))
+        o = put32(o, bkd_strindent(line));
+    return o - out;
+}
+
+static size_t strindent_ref(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        uint32_t indent = 0;
+        for (uint32_t i = 0; i < line.length && ref_space(line.data[i]); i++)
+            indent += line.data[i] == ' ' ? 1 : line.data[i] == '\t' ? 4 : 0;
+        o = put32(o, indent);
+    }
+    return o - out;
+}
+
+static size_t strtrim_lib(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        struct bkd_string trimmed = bkd_strtrim_both(line);
+        o = put32(o, trimmed.length ? (uint32_t) (trimmed.data - line.data) : 0);
+        o = put32(o, trimmed.length);
+    }
+    return o - out;
+}
+
+static size_t strtrim_ref(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        uint32_t head = 0, tail = line.length;
+        while (head < tail && ref_space(line.data[head])) head++;
+        while (tail > head && ref_space(line.data[tail - 1])) tail--;
+        o = put32(o, tail > head ? head : 0);
+        o = put32(o, tail - head);
+    }
+    return o - out;
+}
+
+static size_t strempty_lib(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line))
+        *o++ = (uint8_t) bkd_strempty(line);
+    return o - out;
+}
+
+static size_t strempty_ref(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        uint32_t i = 0;
+        while (i < line.length && ref_space(line.data[i])) i++;
+        *o++ = i == line.length;
+    }
+    return o - out;
+}
+
+/* Strips a list item's worth of indentation, as the parser does for every
+ * line inside an item. */
+#define STRIP 4
+
+static size_t strstripn_lib(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        struct bkd_string stripped = bkd_strstripn_new(line, STRIP);
+        o = put32(o, stripped.length);
+        memcpy(o, stripped.data, stripped.length);
+        o += stripped.length;
+        if (line.length)
+            bkd_strfree(stripped);
+    }
+    return o - out;
+}
+
+static size_t strstripn_ref(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        uint32_t leading = 0, pos = 0, codepoint, padding, length;
+        uint8_t * copy;
+        if (!line.length) {
+            o = put32(o, 0);
+        } else {
+            while (leading < STRIP && pos < line.length) {
+                leading += line.data[pos] == '\t' ? 4 : 1;
+                pos += bkd_utf8_readlen(line.data + pos, &codepoint, line.length - pos);
+            }
+            padding = leading < STRIP ? 0 : leading - STRIP;
+            length = leading < STRIP ? 0 : padding + line.length - pos;
+            copy = BKD_MALLOC(length ? length : 1);
+            memset(copy, ' ', padding);
+            memcpy(copy + padding, line.data + pos, length - padding);
+            o = put32(o, length);
+            memcpy(o, copy, length);
+            o += length;
+            BKD_FREE(copy);
+        }
+    }
+    return o - out;
+}
+
+/* Escapes and delimiters */
+
+static size_t strescape_lib(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        struct bkd_string unescaped = bkd_strescape_new(line);
+        o = put32(o, unescaped.length);
+        memcpy(o, unescaped.data, unescaped.length);
+        o += unescaped.length;
+        bkd_strfree(unescaped);
+    }
+    return o - out;
+}
+
+static size_t strescape_ref(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        uint8_t * copy = BKD_MALLOC(line.length + 1);
+        uint32_t pos = 0, n = 0, length = 0;
+        while (pos < line.length) {
+            if (line.data[pos] != '\\') {
+                copy[n++] = line.data[pos++];
+                continue;
+            }
+            if (++pos >= line.length)
+                break;
+            n += bkd_utf8_write(copy + n, read_escape(bkd_strsub(line, pos, -1), &length));
+            pos += length;
+        }
+        o = put32(o, n);
+        memcpy(o, copy, n);
+        o += n;
+        BKD_FREE(copy);
+    }
+    return o - out;
+}
+
+static size_t find_one_lib(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        uint32_t index, c;
+        while ((c = find_one(line, brackets, 2, &index))) {
+            o = put32(o, c);
+            o = put32(o, index);
+            line.data += index + 1;
+            line.length -= index + 1;
+        }
+    }
+    return o - out;
+}
+
+static size_t find_one_ref(const struct input * in, uint8_t * out) {
+    uint8_t * o = out;
+    struct bkd_string line;
+    uint32_t at = 0;
+    while (next_line(in, &at, &line)) {
+        uint32_t pos = 0, start = 0, length = 0;
+        uint8_t c;
+        while (pos < line.length) {
+            c = line.data[pos++];
+            if (c == '\\') {
+                if (pos < line.length) {
+                    read_escape(bkd_strsub(line, pos, -1), &length);
+                    pos += length;
+                }
+            } else if (c == '[' || c == ']') {
+                o = put32(o, c);
+                o = put32(o, pos - 1 - start);
+                start = pos;
+            }
+        }
+    }
+    return o - out;
+}
+
+/* HTML text escaping, in the chunks the renderer writes. */
+
+static size_t html_escape(const struct input * in, uint8_t * out, uint32_t flags) {
+    uint8_t * o = out;
+    struct bkd_string text = in->text;
+    uint32_t used, written;
+    while (text.length) {
+        used = html_escape_into(text, flags, o, KERNEL_HTMLCHUNK, &written);
+        o += written;
+        text.data += used;
+        text.length -= used;
+    }
+    return o - out;
+}
+
+static size_t html_escape_ref(const struct input * in, uint8_t * out, uint32_t flags) {
+    uint8_t * o = out;
+    uint32_t pos = 0, codepoint;
+    while (pos < in->text.length) {
+        pos += bkd_utf8_readlen(in->text.data + pos, &codepoint, in->text.length - pos);
+        o += html_write_text(codepoint, flags, o);
+    }
+    return o - out;
+}
+
+static size_t html_lib(const struct input * in, uint8_t * out) {
+    return html_escape(in, out, 0);
+}
+
+static size_t html_ref(const struct input * in, uint8_t * out) {
+    return html_escape_ref(in, out, 0);
+}
+
+static size_t html_raw_lib(const struct input * in, uint8_t * out) {
+    return html_escape(in, out, htmlflag_raw);
+}
+
+static size_t html_raw_ref(const struct input * in, uint8_t * out) {
+    return html_escape_ref(in, out, htmlflag_raw);
+}
+
+/* Byte scanners, reporting every byte they stop at. */
+
+static size_t scan_all(const struct input * in, uint8_t * out, uint32_t (*scan)(const uint8_t *, uint32_t)) {
+    uint8_t * o = out;
+    uint32_t pos = 0;
+    while ((pos += scan(in->text.data + pos, in->text.length - pos)) < in->text.length)
+        o = put32(o, pos++);
+    return o - out;
+}
+
+static uint32_t delim_ref(const uint8_t * data, uint32_t length) {
+    uint32_t i;
+    for (i = 0; i < length; i++)
+        if (data[i] == '[' || data[i] == ']' || data[i] == '(' || data[i] == ')' ||
+                data[i] == '|' || data[i] == '\\')
+            break;
+    return i;
+}
+
+static uint32_t html_special_ref(const uint8_t * data, uint32_t length) {
+    uint32_t i;
+    for (i = 0; i < length; i++)
+        if (html_special(data[i], 0))
+            break;
+    return i;
+}
+
+static size_t scan_delim_lib(const struct input * in, uint8_t * out) {
+    return scan_all(in, out, bkd_scan_delim);
+}
+
+static size_t scan_delim_ref(const struct input * in, uint8_t * out) {
+    return scan_all(in, out, delim_ref);
+}
+
+static size_t scan_html_lib(const struct input * in, uint8_t * out) {
+    return scan_all(in, out, bkd_scan_html);
+}
+
+static size_t scan_html_ref(const struct input * in, uint8_t * out) {
+    return scan_all(in, out, html_special_ref);
+}
+
+struct kernel {
+    const char * name;
+    size_t (*lib)(const struct input * in, uint8_t * out);
+    size_t (*ref)(const struct input * in, uint8_t * out);
+};
+
+static const struct kernel kernels[] = {
+    {"utf8_read", utf8_read_lib, utf8_read_ref},
+    {"utf8_readlen", utf8_readlen_lib, utf8_read_ref},
+    {"utf8_write", utf8_write_lib, utf8_write_ref},
+    {"strindent", strindent_lib, strindent_ref},
+    {"strtrim", strtrim_lib, strtrim_ref},
+    {"strempty", strempty_lib, strempty_ref},
+    {"strstripn_new", strstripn_lib, strstripn_ref},
+    {"strescape_new", strescape_lib, strescape_ref},
+    {"find_one", find_one_lib, find_one_ref},
+    {"html_escape", html_lib, html_ref},
+    {"html_escape_raw", html_raw_lib, html_raw_ref},
+    {"scan_delim", scan_delim_lib, scan_delim_ref},
+    {"scan_html", scan_html_lib, scan_html_ref}
+};
+
+#define KERNELCOUNT (sizeof(kernels) / sizeof(*kernels))
+
+/* Character mixes */
+
+enum mix { MIX_ASCII, MIX_MARKUP, MIX_UTF8, MIX_CJK, MIX_BLANK, MIX_COUNT };
+
+static const char * mixNames[] = {"ascii", "markup", "utf8", "cjk", "blank"};
+
+static void put_char(struct bench_text * t, enum mix mix) {
+    static const char * markup[] = {"[", "]", "(", ")", "|", "\\n", "\\[", "\\(263A)", "[B:", "<", "&", "\""};
+    static const uint32_t starts[] = {0xA0, 0x391, 0x4E00, 0x1F600};
+    char buffer[8];
+    uint32_t r = bench_rand(100);
+    switch (mix) {
+        case MIX_MARKUP:
+            if (r < 30) {
+                bench_puts(t, markup[bench_rand(sizeof(markup) / sizeof(*markup))]);
+                return;
+            }
+            /* fallthrough */
+        case MIX_ASCII:
+            buffer[0] = r < 15 ? ' ' : 'a' + bench_rand(26);
+            buffer[1] = '\0';
+            break;
+        case MIX_UTF8:
+            if (r < 50) {
+                buffer[0] = r < 8 ? ' ' : 'a' + bench_rand(26);
+                buffer[1] = '\0';
+            } else {
+                buffer[bkd_utf8_write((uint8_t *) buffer, starts[bench_rand(4)] + bench_rand(0x40))] = '\0';
+            }
+            break;
+        case MIX_CJK:
+            buffer[bkd_utf8_write((uint8_t *) buffer, 0x4E00 + bench_rand(0x5200))] = '\0';
+            break;
+        default:
+            buffer[0] = r < 70 ? ' ' : r < 90 ? '\t' : '\r';
+            buffer[1] = '\0';
+            break;
+    }
+    bench_puts(t, buffer);
+}
+
+/* Lines of a few dozen characters with some indentation and trailing space. */
+static void make_input(struct input * in, enum mix mix, uint32_t size) {
+    struct bench_text t = {NULL, 0, 0};
+    uint32_t pos, codepoint;
+    bench_seed = 12345 + mix;
+    while (t.length < size) {
+        for (uint32_t indent = bench_rand(10); indent; indent--)
+            bench_puts(&t, bench_rand(4) ? " " : "\t");
+        for (uint32_t n = bench_rand(60); n; n--)
+            put_char(&t, mix);
+        if (!bench_rand(3))
+            bench_puts(&t, "  ");
+        bench_puts(&t, "\n");
+    }
+    /* Cut at a character boundary, with zeros after the end for
+     * bkd_utf8_read, which does not know where the input ends. */
+    while (t.length > size && (t.data[size] & 0xC0) == 0x80)
+        size--;
+    t.data = realloc(t.data, size + 4);
+    memset(t.data + size, 0, 4);
+    in->text.data = (uint8_t *) t.data;
+    in->text.length = size;
+    in->codepoints = malloc((in->text.length + 1) * sizeof(uint32_t));
+    in->codepointCount = 0;
+    for (pos = 0; pos < in->text.length; ) {
+        pos += bkd_utf8_readlen(in->text.data + pos, &codepoint, in->text.length - pos);
+        in->codepoints[in->codepointCount++] = codepoint;
+    }
+}
+
+struct timing {
+    double mean;
+    double deviation;
+};
+
+/* Times fn on the input, in ns per input byte. */
+static struct timing measure(size_t (*fn)(const struct input *, uint8_t *),
+        const struct input * in, uint8_t * out) {
+    double samples[KERNEL_SAMPLES], start, elapsed, sum = 0, square = 0;
+    struct timing timing;
+    uint32_t runs, batch;
+    for (int i = 0; i < KERNEL_SAMPLES; i++) {
+        runs = 0;
+        start = bench_now();
+        /* Runs in growing batches, so reading the clock costs little even
+         * for the smallest inputs. */
+        for (batch = 1; ; batch *= 2) {
+            for (uint32_t j = 0; j < batch; j++)
+                fn(in, out);
+            runs += batch;
+            if ((elapsed = bench_now() - start) >= KERNEL_MINTIME)
+                break;
+        }
+        samples[i] = elapsed * 1e9 / runs / in->text.length;
+        sum += samples[i];
+    }
+    timing.mean = sum / KERNEL_SAMPLES;
+    for (int i = 0; i < KERNEL_SAMPLES; i++)
+        square += (samples[i] - timing.mean) * (samples[i] - timing.mean);
+    timing.deviation = sqrt(square / (KERNEL_SAMPLES - 1));
+    return timing;
+}
+
+static int selected(const char * name, char ** names, int count) {
+    if (!count) return 1;
+    for (int i = 0; i < count; i++)
+        if (!strcmp(names[i], name))
+            return 1;
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    struct input inputs[MIX_COUNT][SIZECOUNT];
+    struct timing lib, ref;
+    uint8_t * libOut, * refOut;
+    size_t libLength, refLength, room = 16 * sizes[SIZECOUNT - 1] + 64;
+    uint32_t mismatches = 0;
+    libOut = malloc(room);
+    refOut = malloc(room);
+    for (int m = 0; m < MIX_COUNT; m++)
+        for (size_t s = 0; s < SIZECOUNT; s++)
+            make_input(&inputs[m][s], m, sizes[s]);
+    printf("# kernel mix bytes lib_ns/B lib_sd scalar_ns/B scalar_sd speedup\n");
+    for (size_t k = 0; k < KERNELCOUNT; k++) {
+        if (!selected(kernels[k].name, argv + 1, argc - 1))
+            continue;
+        for (int m = 0; m < MIX_COUNT; m++) {
+            for (size_t s = 0; s < SIZECOUNT; s++) {
+                const struct input * in = &inputs[m][s];
+                libLength = kernels[k].lib(in, libOut);
+                refLength = kernels[k].ref(in, refOut);
+                lib = measure(kernels[k].lib, in, libOut);
+                ref = measure(kernels[k].ref, in, refOut);
+                printf("%-15s %-6s %7u %8.3f %7.3f %8.3f %7.3f %6.2fx",
+                        kernels[k].name, mixNames[m], in->text.length,
+                        lib.mean, lib.deviation, ref.mean, ref.deviation, ref.mean / lib.mean);
+                if (libLength != refLength || memcmp(libOut, refOut, libLength)) {
+                    printf("  MISMATCH");
+                    mismatches++;
+                }
+                printf("\n");
+                fflush(stdout);
+            }
+        }
+    }
+    for (int m = 0; m < MIX_COUNT; m++) {
+        for (size_t s = 0; s < SIZECOUNT; s++) {
+            free(inputs[m][s].text.data);
+            free(inputs[m][s].codepoints);
+        }
+    }
+    free(libOut);
+    free(refOut);
+    if (mismatches) {
+        printf("kernels: %u mismatch%s\n", mismatches, mismatches == 1 ? "" : "es");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Parses list-heavy input, with and without an arena, and reports the time
+ * and the number of allocations. Every list item pushes two parse frames, so
+ * this shows what the block parser costs per frame.
+ */
+
+#include "bench.h"
+#include "bkd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static void gen_list(struct bench_text * t, uint32_t depth, uint32_t items) {
+    static const char markers[] = "%*@&+-";
+    char marker = markers[bench_rand(sizeof(markers) - 1)];
+    for (uint32_t i = 0; i < items; i++) {
+        bench_printf(t, "%*s%c item %u with [B:bold] text\n", 2 * depth, "", marker, i);
+        if (depth < 4 && bench_rand(10) < 3) {
+            bench_printf(t, "\n");
+            gen_list(t, depth + 1, 1 + bench_rand(5));
+            bench_printf(t, "\n");
+        }
+    }
+}
+
+static void run(const struct bench_text * input, uint32_t options, const char * name) {
+    struct bench_counts before, after;
+    struct bkd_list * document;
+    double best = 0, start, elapsed;
+    for (int i = 0; i < 3; i++) {
+        before = bench_counts;
+        start = bench_now();
+        document = bkd_parse_buffer_opt((const uint8_t *) input->data, input->length, options);
+        elapsed = bench_now() - start;
+        after = bench_counts;
+        bkd_docfree(document);
+        if (i == 0 || elapsed < best)
+            best = elapsed;
+    }
+    printf("lists %-6s %8.1f MB/s %10lu allocs %10lu reallocs %10lu live\n",
+            name,
+            input->length / 1e6 / best,
+            after.allocs - before.allocs,
+            after.reallocs - before.reallocs,
+            (after.allocs - before.allocs) - (after.frees - before.frees));
+}
+
+int main(void) {
+    struct bench_text input = {NULL, 0, 0};
+    while (input.length < 8 * 1000 * 1000) {
+        gen_list(&input, 0, 3 + bench_rand(28));
+        bench_printf(&input, "\n");
+    }
+    run(&input, 0, "tree");
+    run(&input, BKD_PARSE_ARENA, "arena");
+    free(input.data);
+    return 0;
+}
@@ -58,6 +58,10 @@ static struct cli_option options[] = {
     {"style-file", 'f', 1, "Inserts a CSS style inline into the output HTML"},
     {"script", 'T', 1, "Inserts a script via href into the output HTML"},
     {"style", 't', 1, "Inserts a css stylesheet via href into the output HTML"},
+    {"stream", 'S', 2, "Writes each top level block as soon as it is parsed, without holding the document"},
+    {"flush", 'n', 1, "Flushes output after every N top level blocks when streaming, or only at the end if 0"},
+    {"compact", 'c', 2, "Holds the document in a compact form while parsing, which takes much less memory"},
+    {"utf8", 'u', 2, "Writes text as UTF-8 instead of escaping everything past ASCII"},
     {"version", 'v', 2, "Prints the version"},
     {"help", 'h', 2, "Prints the help description"}
 };
@@ -104,15 +108,85 @@ static int getopt(const char * arg) {
     return 0;
 }
 
-struct bkd_istream loadfile(struct bkd_string filename) {
-    FILE *f = fopen((char *)filename.data, "r");
-    return bkd_file_istream(f);
+/* Opens a file as an input stream. Regular files are memory mapped where
+ * that is available, otherwise the file is read through stdio. */
+static struct bkd_istream * openfile(struct bkd_istream * stream, const char * path) {
+#ifndef BKD_NO_POSIX
+    return bkd_mmap_istream(stream, path);
+#else
+    FILE * file = fopen(path, "rb");
+    if (!file) return NULL;
+    *stream = bkd_file_istream(file);
+    return stream;
+#endif
+}
+
+/* Opens standard input as an input stream, mapped if it is a regular file. */
+static struct bkd_istream * openstdin(struct bkd_istream * stream) {
+#ifndef BKD_NO_POSIX
+    return bkd_mmap_istream_fd(stream, 0);
+#else
+    *stream = bkd_file_istream(stdin);
+    return stream;
+#endif
+}
+
+/* Closes a stream from openfile or openstdin. Without POSIX, the streams
+ * are plain stdio streams that do not close their files themselves. */
+static void closefile(struct bkd_istream * stream) {
+#ifdef BKD_NO_POSIX
+    if (stream->user != stdin)
+        fclose((FILE *) stream->user);
+#endif
+    bkd_istream_close(stream);
+}
+
+static struct bkd_istream * loadfile(struct bkd_string filename) {
+    struct bkd_istream * stream = BKD_MALLOC(sizeof(struct bkd_istream));
+    if (!stream) return NULL;
+    if (!openfile(stream, (char *)filename.data)) {
+        BKD_FREE(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+/* State for writing blocks as they come out of the parser. */
+struct cli_stream {
+    uint32_t options;
+    uint32_t flushEvery;
+    uint32_t sinceFlush;
+};
+
+static void stream_node(void * user, struct bkd_node * node) {
+    struct cli_stream * s = (struct cli_stream *) user;
+    bkd_html_fragment_opt(BKD_STDOUT, node, s->options);
+    if (s->flushEvery && ++s->sinceFlush >= s->flushEvery) {
+        bkd_flush(BKD_STDOUT);
+        s->sinceFlush = 0;
+    }
+}
+
+/* State for building a compact document. Appending stops at the first
+ * error, so a failed document is never printed short. */
+struct cli_compact {
+    struct bkd_compact compact;
+    int error;
+};
+
+static void compact_node(void * user, struct bkd_node * node) {
+    struct cli_compact * c = (struct cli_compact *) user;
+    if (!c->error)
+        c->error = bkd_compact_append(&c->compact, node);
 }
 
 int main(int argc, char *argv[]) {
     int64_t currentArg = 1;
     uint32_t print_options = 0;
     struct bkd_htmlinsert *inserts = NULL;
+    const char * inputPath = NULL;
+    struct bkd_istream input;
+    int status = 0;
 
     /* Clear opts */
     memset(opts, 0, sizeof(opts));
@@ -122,32 +196,44 @@ int main(int argc, char *argv[]) {
         char * arg = argv[currentArg];
         /* text option */
         struct bkd_htmlinsert insert;
+        int isInsert = 1;
+        /* Anything that isn't an option is the input file. */
+        if (arg[0] != '-' && !inputPath) {
+            inputPath = arg;
+            continue;
+        }
         int option = getopt(arg);
         switch(option) {
             case -1: return 1;
             case 'I': /* script inline */
                      insert.type = BKD_HTML_INSERTSCRIPT;
                      insert.data.string = opts['I'].data;
+                     break;
             case 'i': /* style inline */
                      insert.type = BKD_HTML_INSERTSTYLE;
                      insert.data.string = opts['i'].data;
+                     break;
             case 'F': /* script file */
                      insert.type = BKD_HTML_INSERTSCRIPT | BKD_HTML_INSERT_ISSTREAM;
-                     insert.data.stream = BKD_MALLOC(sizeof(struct bkd_istream));
-                     *insert.data.stream = loadfile(opts['F'].data);
+                     insert.data.stream = loadfile(opts['F'].data);
+                     if (!insert.data.stream) return 1;
+                     break;
             case 'f': /* style file */
                      insert.type = BKD_HTML_INSERTSTYLE | BKD_HTML_INSERT_ISSTREAM;
-                     insert.data.stream = BKD_MALLOC(sizeof(struct bkd_istream));
-                     *insert.data.stream = loadfile(opts['f'].data);
+                     insert.data.stream = loadfile(opts['f'].data);
+                     if (!insert.data.stream) return 1;
+                     break;
             case 'T': /* script link */
                      insert.type = BKD_HTML_INSERTSCRIPT | BKD_HTML_INSERT_ISLINK;
                      insert.data.string = opts['T'].data;
+                     break;
             case 't': /* style link*/
                      insert.type = BKD_HTML_INSERTSTYLE | BKD_HTML_INSERT_ISLINK;
                      insert.data.string = opts['t'].data;
-            default: break;
+                     break;
+            default: isInsert = 0; break;
         }
-        if (option != 0) {
+        if (isInsert) {
             bkd_sbpush(inserts, insert);
         }
     }
@@ -161,7 +247,7 @@ int main(int argc, char *argv[]) {
     /* Show help text and exit */
     if (opts['h'].valid) {
         printf(cli_title);
-        printf("\n%s [options] < filein.bkd > fileout.bkd\n\n", argv[0]);
+        printf("\n%s [options] [filein.bkd] < filein.bkd > fileout.html\n\n", argv[0]);
         int size = sizeof(options) / sizeof(options[0]);
         for (int i = 0; i < size; ++i) {
             struct cli_option o = options[i];
@@ -183,24 +269,61 @@ int main(int argc, char *argv[]) {
         print_options |= BKD_OPTION_STANDALONE;
     }
 
-    struct bkd_list * doc = bkd_parse(BKD_STDIN);
+    if (opts['u'].valid) {
+        print_options |= BKD_OPTION_RAWUTF8;
+    }
 
-    bkd_html(BKD_STDOUT, doc, print_options, bkd_sbcount(inserts), inserts);
-    fflush(stdout);
+    /* Map the input if we can, otherwise read it as a stream. */
+    if (inputPath) {
+        if (!openfile(&input, inputPath)) return 1;
+    } else {
+        if (!openstdin(&input)) return 1;
+    }
 
-    bkd_docfree(doc);
+    if (opts['S'].valid) {
+        struct cli_stream stream;
+        stream.options = print_options;
+        stream.flushEvery = opts['n'].valid ? strtoul((char *) opts['n'].data.data, NULL, 10) : 1;
+        stream.sinceFlush = 0;
+        bkd_html_begin(BKD_STDOUT, print_options, bkd_sbcount(inserts), inserts);
+        if (stream.flushEvery)
+            bkd_flush(BKD_STDOUT);
+        if (bkd_parse_each(&input, stream_node, &stream))
+            status = 1;
+        bkd_html_end(BKD_STDOUT, print_options);
+        bkd_flush(BKD_STDOUT);
+    } else if (opts['c'].valid) {
+        struct cli_compact compact;
+        compact.error = bkd_compact_init(&compact.compact, BKD_LISTSTYLE_NONE);
+        if (!compact.error && bkd_parse_each(&input, compact_node, &compact) && !compact.error)
+            compact.error = 1;
+        if (!compact.error)
+            compact.error = bkd_compact_shrink(&compact.compact);
+        if (!compact.error) {
+            bkd_html_compact(BKD_STDOUT, &compact.compact, print_options, bkd_sbcount(inserts), inserts);
+            bkd_flush(BKD_STDOUT);
+        } else {
+            status = 1;
+        }
+        bkd_compact_free(&compact.compact);
+    } else {
+        struct bkd_list * doc = bkd_parse_opt(&input, BKD_PARSE_ARENA | BKD_PARSE_BORROW | BKD_PARSE_INTERN);
+        if (!doc) return 1;
+        bkd_html(BKD_STDOUT, doc, print_options, bkd_sbcount(inserts), inserts);
+        bkd_flush(BKD_STDOUT);
+        bkd_docfree(doc);
+    }
 
     /* Close ingoing files */
     for (int32_t i = 0; i < bkd_sbcount(inserts); ++i) {
         if (inserts[i].type & BKD_HTML_INSERT_ISSTREAM) {
-            bkd_istream_freebuf(inserts[i].data.stream);
-            fclose((FILE *) inserts[i].data.stream->user);
+            closefile(inserts[i].data.stream);
             BKD_FREE(inserts[i].data.stream);
         }
     }
 
     bkd_sbfree(inserts);
 
-    bkd_istream_freebuf(BKD_STDIN);
-    return 0;
+    closefile(&input);
+    return status;
 }
@@ -81,6 +81,16 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define BKD_ANCHOR 2048
 #define BKD_INTERNALLINK 4096
 
+/*
+ * The high bits of a markup are not markups. They mark strings that the
+ * linenode does not own: either they point into the parser's input, or they
+ * are shared through the document's intern table. Mask them off with
+ * BKD_MARKUP_MASK when comparing markups.
+ */
+#define BKD_BORROWEDLEAF 0x40000000
+#define BKD_BORROWEDDATA 0x80000000
+#define BKD_MARKUP_MASK 0x3FFFFFFF
+
 /*
  * Different styles for sub documents, or lists.
  */
@@ -103,6 +113,31 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 /* Document printing options */
 #define BKD_OPTION_STANDALONE 1
+/* Writes text past ASCII as UTF-8 instead of as character references. Only
+ * the characters that HTML gives meaning to are escaped. */
+#define BKD_OPTION_RAWUTF8 2
+
+/* Markup in a line nests at most this deep. Brackets any deeper are kept as
+ * literal text. */
+#ifndef BKD_LINE_MAXDEPTH
+#define BKD_LINE_MAXDEPTH 256
+#endif
+
+/* Parsing options. With BKD_PARSE_ARENA, all memory for the document comes
+ * from a few large blocks that bkd_docfree releases at once, so the nodes
+ * of such a document must not be freed or reallocated one by one. */
+#define BKD_PARSE_ARENA 1
+
+/* With BKD_PARSE_BORROW, text without escapes points straight into the input
+ * instead of being copied, so the input must outlive the document. Only
+ * memory buffers and streams that set BKD_ISTREAM_STABLE, such as string
+ * streams and mapped files, are borrowed from, and never lines that a
+ * stream reads into its own buffer. */
+#define BKD_PARSE_BORROW 2
+
+/* With BKD_PARSE_INTERN, equal link targets and custom classes share one
+ * copy per document. */
+#define BKD_PARSE_INTERN 4
 
 /* Strings */
 struct bkd_string {
@@ -156,6 +191,8 @@ struct bkd_list {
     uint32_t style;
     uint32_t itemCount;
     struct bkd_node * items;
+    /* Private. Set by the parser on the documents it returns. */
+    void * owner;
 };
 
 struct bkd_node {
@@ -179,6 +216,7 @@ struct bkd_ostream;
 struct bkd_ostreamdef {
     int (*stream)(struct bkd_ostream * self, const struct bkd_string data);
     int (*flush)(struct bkd_ostream * self);
+    void (*close)(struct bkd_ostream * self);
 };
 
 struct bkd_ostream {
@@ -190,12 +228,19 @@ int bkd_putn(struct bkd_ostream * out, struct bkd_string str);
 int bkd_puts(struct bkd_ostream * out, const char * str);
 int bkd_putc(struct bkd_ostream * out, char c);
 void bkd_flush(struct bkd_ostream * out);
+void bkd_ostream_close(struct bkd_ostream * out);
 
 /* Simple input streams */
 struct bkd_istream;
 
+/* Set in flags by streams whose lines outside of their buffer stay put and
+ * unchanged for as long as the stream is open, such as views into memory. */
+#define BKD_ISTREAM_STABLE 1
+
 struct bkd_istreamdef {
     int (*line)(struct bkd_istream * self);
+    void (*close)(struct bkd_istream * self);
+    uint32_t flags;
 };
 
 /* Buffers */
@@ -204,21 +249,38 @@ struct bkd_buffer {
     struct bkd_string string;
 };
 
+/* The current line is in line. It either points into buffer or, for streams
+ * that can hand out views, directly into the underlying memory. Streams that
+ * read in blocks keep unconsumed input in buffer, starting at offset. */
 struct bkd_istream {
     struct bkd_istreamdef * type;
     void * user;
     struct bkd_buffer buffer;
+    struct bkd_string line;
+    uint32_t offset;
     uint8_t done;
 };
 
 struct bkd_string bkd_getl(struct bkd_istream * in);
 struct bkd_string bkd_lastl(struct bkd_istream * in);
 void bkd_istream_freebuf(struct bkd_istream * in);
+void bkd_istream_close(struct bkd_istream * in);
 
+/* In memory streams. The string input stream hands out lines as views into
+ * string, which must outlive the stream. The string output stream grows as
+ * needed, and bkd_string_ostream_take hands over its contents without a copy.
+ * If it runs out of memory, writes return BKD_ERROR_OUT_OF_MEMORY. Release
+ * both with their close functions. */
 extern struct bkd_istreamdef * BKD_STRING_ISTREAMDEF;
 extern struct bkd_ostreamdef * BKD_STRING_OSTREAMDEF;
-
-/* Standard IO Streams */
+struct bkd_istream bkd_string_istream(struct bkd_string string);
+struct bkd_ostream bkd_string_ostream(void);
+struct bkd_string bkd_string_ostream_take(struct bkd_ostream * out);
+
+/* Standard IO Streams. Unless BKD_NO_POSIX is defined, file input streams
+ * read the file's descriptor with read(2), and each line is handed out as
+ * soon as it has arrived. Anything already read into the FILE's own buffer
+ * through stdio is not seen. */
 #ifndef BKD_NO_STDIO
 #include <stdio.h>
 extern struct bkd_istreamdef * BKD_FILE_ISTREAMDEF;
@@ -229,6 +291,22 @@ struct bkd_istream bkd_file_istream(FILE * file);
 struct bkd_ostream bkd_file_ostream(FILE * file);
 #endif
 
+/* Memory mapped input streams. Lines are views into the mapping. Files that
+ * cannot be mapped, such as pipes, fall back to a stdio stream. Returns NULL
+ * if the file could not be opened. Release with bkd_istream_close. */
+#if !defined(BKD_NO_STDIO) && !defined(BKD_NO_POSIX)
+struct bkd_istream * bkd_mmap_istream(struct bkd_istream * stream, const char * path);
+struct bkd_istream * bkd_mmap_istream_fd(struct bkd_istream * stream, int fd);
+#endif
+
+/* Buffered output to a file descriptor. Output is collected in a block of
+ * blocksize bytes and written with write/writev when the block fills or the
+ * stream is flushed. BKD_STDOUT is such a stream, so it must be flushed before
+ * writing to stdout by other means. Release with bkd_ostream_close. */
+#if !defined(BKD_NO_STDIO) && !defined(BKD_NO_POSIX)
+struct bkd_ostream * bkd_fd_ostream(struct bkd_ostream * stream, int fd, uint32_t blocksize);
+#endif
+
 /* Define NULL in case stdlib not included */
 #ifndef NULL
 #define NULL ((void *)0)
@@ -251,11 +329,177 @@ extern const char * bkd_errors[];
 #define BKD_ERROR_INVALID_MARKUP_PATTERN 3
 #define BKD_ERROR_UNKNOWN_NODE 4
 #define BKD_ERROR_UNKNOWN 5
+#define BKD_ERROR_IO 6
 
 /* Main Functions */
 struct bkd_list * bkd_parse(struct bkd_istream * in);
+struct bkd_list * bkd_parse_buffer(const uint8_t * data, size_t size);
+struct bkd_list * bkd_parse_opt(struct bkd_istream * in, uint32_t options);
+struct bkd_list * bkd_parse_buffer_opt(const uint8_t * data, size_t size, uint32_t options);
+
+/* Push parser for input that arrives in chunks. Chunks may split lines and
+ * UTF-8 sequences anywhere. bkd_parser_feed returns 0, or the first error,
+ * such as BKD_ERROR_OUT_OF_MEMORY, after which later calls only return it
+ * again. bkd_parser_finish returns the document, or NULL after an error, and
+ * frees the parser. */
+struct bkd_parser;
+struct bkd_parser * bkd_parser_new(void);
+int bkd_parser_feed(struct bkd_parser * parser, const uint8_t * bytes, size_t n);
+struct bkd_list * bkd_parser_finish(struct bkd_parser * parser);
+
+/* Frees a document from the parser, along with its arena and intern table.
+ * Any other list is freed node by node, so it and everything in it must come
+ * from BKD_MALLOC. The parsers return NULL if they fail, for instance when
+ * they run out of memory, which bkd_docfree ignores. */
 void bkd_docfree(struct bkd_list * document);
 
+/* Event parser. Instead of building a document, each block is reported to the
+ * handler and freed as soon as it is complete, so memory use depends on the
+ * nesting depth and the largest single block rather than the document size.
+ * Lists report open when their first item is known and close when they end;
+ * their nodes carry the style but no items. Other blocks are reported whole:
+ * open gets the complete node, then the inline events for its text (or the
+ * cells of a table) follow, then close. Any callback may be NULL. */
+struct bkd_handler {
+    void * user;
+    void (*open)(void * user, const struct bkd_node * node);
+    void (*close)(void * user, const struct bkd_node * node);
+    void (*markupOpen)(void * user, uint32_t markup, struct bkd_string data);
+    void (*markupClose)(void * user, uint32_t markup, struct bkd_string data);
+    void (*text)(void * user, struct bkd_string text);
+};
+
+/* Returns 0, or the first error. Parsing stops at an error, and the blocks
+ * that are still open are then reported as they are. */
+int bkd_parse_events(struct bkd_istream * in, const struct bkd_handler * handler);
+
+/* Calls each with every top level node as soon as it is complete, and frees
+ * the node once each returns. Returns like bkd_parse_events. */
+int bkd_parse_each(struct bkd_istream * in, void (*each)(void * user, struct bkd_node * node), void * user);
+
 struct bkd_linenode * bkd_parse_line(struct bkd_linenode * node, struct bkd_string string);
 
+/* Tree walks. bkd_walk_next goes depth first through count nodes and
+ * everything in them without recursion. It visits every block node and line
+ * node on the way in (BKD_WALK_ENTER) and on the way out (BKD_WALK_LEAVE),
+ * once all of its children have been visited. A node without children is
+ * visited once, with both flags set. Each call returns the flags, with the
+ * visited node on top of the stack and its ancestors below it, or 0 when the
+ * walk is over or the stack could not grow, which sets error.
+ *
+ * The stack holds one frame per level of nesting. It stays in frames up to
+ * BKD_WALK_FRAMES levels and moves to the heap past that, so memory grows
+ * only with the depth of the document. Nothing in a walk needs to outlive the
+ * step that visits it, so the work for a node may free the children it has
+ * already left. bkd_walk_free releases the heap stack. */
+#ifndef BKD_WALK_FRAMES
+#define BKD_WALK_FRAMES 32
+#endif
+
+#define BKD_WALK_ENTER 1
+#define BKD_WALK_LEAVE 2
+
+struct bkd_walkframe {
+    const struct bkd_node * node;      /* NULL for line nodes */
+    const struct bkd_linenode * line;  /* NULL for block nodes */
+    uint32_t index;                    /* Position among its siblings */
+
+    /* The children: count block nodes at items, or line nodes at lines */
+    const struct bkd_node * items;
+    const struct bkd_linenode * lines;
+    uint32_t count;
+    uint32_t next;
+};
+
+/* The stack points at frames until it moves to the heap, so a walk must not
+ * be copied. */
+struct bkd_walk {
+    struct bkd_walkframe root;
+    struct bkd_walkframe frames[BKD_WALK_FRAMES];
+    struct bkd_walkframe * stack;
+    uint32_t capacity;
+    uint32_t depth;
+    uint8_t left;
+    int error;
+};
+
+void bkd_walk_init(struct bkd_walk * walk, const struct bkd_node * items, uint32_t count);
+int bkd_walk_next(struct bkd_walk * walk);
+void bkd_walk_free(struct bkd_walk * walk);
+
+#define bkd_walk_top(W) ((W)->stack + (W)->depth - 1)
+
+/* Compact documents. Nodes are numbered in document order and stored as
+ * parallel arrays indexed by id. Node 0 is the document itself, a list. The
+ * children of a node are the nodes from id + 1 up to next[id], each followed
+ * by its own descendants, so the first child is id + 1 and each child's next
+ * is its sibling. Block nodes keep their type; the text of a paragraph,
+ * header, comment or plain text block is its only child, a BKD_COMPACT_LINE.
+ *
+ * All text is in one buffer, in document order, so the text of a node runs
+ * from textStarts[id] to textStarts[id + 1]. flags holds the style of a list
+ * or rule, the size of a header or the column count of a table. Data, the
+ * target of a link or the language of a code block, is kept once per
+ * distinct string in a second buffer; dataIds is 0 for nodes without it.
+ *
+ * A line is flat: its text is all of its decoded text, and its markups are
+ * the spans from spanStarts[id] to spanStarts[id + 1]. Spans are in document
+ * order, each followed by the spans nested in it up to last, so they can be
+ * rendered in one pass over the text. Offsets and indices in a span are
+ * relative to its line. */
+#define BKD_COMPACT_LINE BKD_COUNT_TYPE
+
+#define BKD_SPAN_NONE UINT32_MAX
+
+struct bkd_span {
+    uint32_t start;
+    uint32_t end;
+    uint32_t markup;
+    uint32_t data;
+    uint32_t parent;
+    uint32_t last;
+};
+
+struct bkd_compact {
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t * kinds;
+    uint32_t * flags;
+    uint32_t * next;
+    uint32_t * textStarts;
+    uint32_t * spanStarts;
+    uint32_t * dataIds;
+    struct bkd_buffer text;
+
+    uint32_t spanCount;
+    uint32_t spanCapacity;
+    struct bkd_span * spans;
+
+    /* Data string d runs from dataStarts[d - 1] to dataStarts[d] */
+    uint32_t dataCount;
+    uint32_t dataCapacity;
+    uint32_t * dataStarts;
+    struct bkd_buffer data;
+    uint32_t dataCache[256];
+};
+
+/* bkd_compact_append adds a copy of node to the end of the document, so a
+ * compact document can be built from bkd_parse_each without ever holding the
+ * whole tree. bkd_compact_shrink gives back the room kept for growing.
+ * bkd_compact_new converts a whole document into exactly sized arrays. All
+ * return an error code, or 0. */
+int bkd_compact_init(struct bkd_compact * compact, uint32_t style);
+int bkd_compact_append(struct bkd_compact * compact, const struct bkd_node * node);
+int bkd_compact_shrink(struct bkd_compact * compact);
+int bkd_compact_new(struct bkd_compact * compact, const struct bkd_list * document);
+void bkd_compact_free(struct bkd_compact * compact);
+
+#define bkd_compact_text(C, ID) ((struct bkd_string) { \
+        (C)->textStarts[(ID) + 1] - (C)->textStarts[ID], \
+        (C)->text.string.data + (C)->textStarts[ID]})
+#define bkd_compact_dataid(C, D) ((D) ? (struct bkd_string) { \
+        (C)->dataStarts[D] - (C)->dataStarts[(D) - 1], \
+        (C)->data.string.data + (C)->dataStarts[(D) - 1]} : BKD_NULLSTR)
+#define bkd_compact_data(C, ID) bkd_compact_dataid(C, (C)->dataIds[ID])
+
 #endif /* end of include guard: BKD_HEADER_ */
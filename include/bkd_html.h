@@ -48,4 +48,133 @@ int bkd_html_fragment(
         struct bkd_ostream * out,
         struct bkd_node * node);
 
+/* Same as bkd_html_fragment, with printing options. Options that only
+ * concern whole documents are ignored. */
+int bkd_html_fragment_opt(
+        struct bkd_ostream * out,
+        struct bkd_node * node,
+        uint32_t options);
+
+/* Render a document in pieces, for example as its nodes come out of
+ * bkd_parse_each. bkd_html_begin writes everything before the first node,
+ * each node is written with bkd_html_fragment_opt, and bkd_html_end closes
+ * the document. With the same options for all three, the result is the same
+ * as calling bkd_html. */
+int bkd_html_begin(
+        struct bkd_ostream * out,
+        uint32_t options,
+        uint32_t insertCount,
+        struct bkd_htmlinsert * inserts);
+
+int bkd_html_end(
+        struct bkd_ostream * out,
+        uint32_t options);
+
+/* Renders a compact document. The result is the same as calling bkd_html on
+ * the document it was made from. */
+int bkd_html_compact(
+        struct bkd_ostream * out,
+        const struct bkd_compact * document,
+        uint32_t options,
+        uint32_t insertCount,
+        struct bkd_htmlinsert * inserts);
+
+/* Resumable rendering. A cursor renders into caller-provided buffers of any
+ * size, a piece at a time, and picks up exactly where it stopped on the next
+ * call. Rendering only allocates when the document nests deeper than
+ * BKD_HTML_CURSOR_FRAMES; call bkd_html_cursor_free when done with a cursor.
+ * The document and inserts must stay alive and unchanged while the cursor is
+ * in use. */
+
+#define BKD_HTML_CURSOR_FRAMES 32
+#define BKD_HTML_ATTRCACHE_SLOTS 16
+#define BKD_HTML_ATTRCACHE_SIZE 120
+
+struct bkd_html_frame {
+    uint8_t kind;
+    uint8_t phase;
+    uint32_t index;
+    uint32_t aux;
+    void * item;
+};
+
+/* An escaped attribute value, such as a link target. */
+struct bkd_html_attrcache {
+    const uint8_t * key;
+    uint32_t keyLength;
+    uint32_t flags;
+    uint32_t length;
+    uint8_t data[BKD_HTML_ATTRCACHE_SIZE];
+};
+
+/* Fields are private. */
+struct bkd_html_cursor {
+    struct bkd_list * document;
+    uint32_t options;
+    uint32_t insertCount;
+    struct bkd_htmlinsert * inserts;
+
+    /* Traversal stack. Uses frames until the document gets too deep. */
+    struct bkd_html_frame frames[BKD_HTML_CURSOR_FRAMES];
+    struct bkd_html_frame * heapFrames;
+    uint32_t stackCount;
+    uint32_t stackCapacity;
+
+    /* Escaped attribute values, by the address of their text. Values that
+     * the parser interned share an address, so they are escaped once. */
+    struct bkd_html_attrcache attrs[BKD_HTML_ATTRCACHE_SLOTS];
+
+    /* Output that did not fit in the last buffer */
+    struct bkd_string pending;
+    uint8_t scratch[16];
+
+    /* Text being escaped */
+    struct bkd_string text;
+    uint32_t textPos;
+    uint32_t textFlags;
+    uint8_t textActive;
+
+    /* Inserted script or style being copied */
+    struct bkd_string raw;
+    uint32_t rawPos;
+    uint32_t rawMatched;
+    struct bkd_string avoid;
+    struct bkd_string replace;
+    struct bkd_istream * rawStream;
+    uint8_t rawActive;
+    uint8_t rawNewline;
+    uint8_t rawForce;
+
+    /* The buffer currently being filled */
+    uint8_t * out;
+    uint32_t room;
+
+    int32_t error;
+    uint8_t done;
+};
+
+int bkd_html_cursor_init(
+        struct bkd_html_cursor * cursor,
+        struct bkd_list * document,
+        uint32_t options,
+        uint32_t insertCount,
+        struct bkd_htmlinsert * inserts);
+
+int bkd_html_cursor_init_fragment(
+        struct bkd_html_cursor * cursor,
+        struct bkd_node * node);
+
+/* Fills buffer with as much output as fits and puts the number of bytes in
+ * written. Returns an error code, or 0. When all output has been produced,
+ * bkd_html_cursor_done is true. */
+int bkd_html_cursor_render(
+        struct bkd_html_cursor * cursor,
+        uint8_t * buffer,
+        uint32_t size,
+        uint32_t * written);
+
+#define bkd_html_cursor_done(C) ((C)->done)
+
+void bkd_html_cursor_free(struct bkd_html_cursor * cursor);
+
 #endif /* end of include guard: BKD_HTML_ */
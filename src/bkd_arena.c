@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "bkd_arena.h"
+
+struct bkd_arenablock {
+    struct bkd_arenablock * next;
+};
+
+/* Blocks start with their header, padded so that data stays aligned. */
+#define ARENA_HEADER ((sizeof(struct bkd_arenablock) + BKD_ARENA_ALIGN - 1) & ~(size_t)(BKD_ARENA_ALIGN - 1))
+
+static inline size_t arena_round(size_t size) {
+    return (size + BKD_ARENA_ALIGN - 1) & ~(size_t)(BKD_ARENA_ALIGN - 1);
+}
+
+void bkd_arena_init(struct bkd_arena * arena) {
+    arena->blocks = NULL;
+    arena->pos = NULL;
+    arena->end = NULL;
+}
+
+/* Adds a block of size bytes. A current block becomes the one allocations
+ * are bumped out of. Other blocks go behind it, so that the space left in
+ * the current block is not lost. */
+static uint8_t * arena_block(struct bkd_arena * arena, size_t size, int current) {
+    struct bkd_arenablock * block = BKD_MALLOC(ARENA_HEADER + size);
+    uint8_t * data;
+    if (!block) {
+        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        return NULL;
+    }
+    data = (uint8_t *) block + ARENA_HEADER;
+    if (current || !arena->blocks) {
+        block->next = arena->blocks;
+        arena->blocks = block;
+    } else {
+        block->next = arena->blocks->next;
+        arena->blocks->next = block;
+    }
+    if (current) {
+        arena->pos = data;
+        arena->end = data + size;
+    }
+    return data;
+}
+
+void * bkd_arena_alloc(struct bkd_arena * arena, size_t size) {
+    uint8_t * ret;
+    size = arena_round(size);
+    if (size > (size_t) (arena->end - arena->pos)) {
+        if (size > BKD_ARENA_BLOCKSIZE / 4)
+            return arena_block(arena, size, 0);
+        if (!arena_block(arena, BKD_ARENA_BLOCKSIZE, 1))
+            return NULL;
+    }
+    ret = arena->pos;
+    arena->pos += size;
+    return ret;
+}
+
+void bkd_arena_shrink(struct bkd_arena * arena, void * ptr, size_t oldsize, size_t newsize) {
+    if ((uint8_t *) ptr + arena_round(oldsize) == arena->pos)
+        arena->pos = (uint8_t *) ptr + arena_round(newsize);
+}
+
+void bkd_arena_free(struct bkd_arena * arena) {
+    struct bkd_arenablock * block = arena->blocks;
+    while (block) {
+        struct bkd_arenablock * next = block->next;
+        BKD_FREE(block);
+        block = next;
+    }
+    bkd_arena_init(arena);
+}
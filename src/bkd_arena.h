@@ -0,0 +1,50 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef BKD_ARENA_
+#define BKD_ARENA_
+
+#include "bkd.h"
+
+/* Bump allocator. Memory comes out of large blocks and is only ever released
+ * all at once, which makes tearing down a big document cheap. Allocations
+ * larger than a quarter block get a block of their own. */
+
+#define BKD_ARENA_BLOCKSIZE 65536
+#define BKD_ARENA_ALIGN 8
+
+struct bkd_arenablock;
+
+struct bkd_arena {
+    struct bkd_arenablock * blocks;
+    uint8_t * pos;
+    uint8_t * end;
+};
+
+void bkd_arena_init(struct bkd_arena * arena);
+void * bkd_arena_alloc(struct bkd_arena * arena, size_t size);
+
+/* Gives back the end of the most recent allocation, if ptr is that allocation. */
+void bkd_arena_shrink(struct bkd_arena * arena, void * ptr, size_t oldsize, size_t newsize);
+
+void bkd_arena_free(struct bkd_arena * arena);
+
+#endif /* end of include guard: BKD_ARENA_ */
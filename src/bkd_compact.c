@@ -0,0 +1,429 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "bkd.h"
+#include "bkd_string.h"
+
+#include <string.h>
+
+#define COMPACT_CACHESLOTS (sizeof(((struct bkd_compact *) 0)->dataCache) / sizeof(uint32_t))
+
+static int compact_oom(void) {
+    BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+    return BKD_ERROR_OUT_OF_MEMORY;
+}
+
+/* Resizes the node arrays to hold capacity nodes. */
+static int compact_resize(struct bkd_compact * c, uint32_t capacity) {
+    void * p;
+#define RESIZE(FIELD, N) \
+    if (!(p = BKD_REALLOC(c->FIELD, (N) * sizeof(*c->FIELD)))) return compact_oom(); \
+    c->FIELD = p;
+    RESIZE(kinds, capacity)
+    RESIZE(flags, capacity)
+    RESIZE(next, capacity)
+    RESIZE(textStarts, capacity + 1)
+    RESIZE(spanStarts, capacity + 1)
+    RESIZE(dataIds, capacity)
+#undef RESIZE
+    c->capacity = capacity;
+    return 0;
+}
+
+/* Makes room for extra more bytes in a buffer. Offsets are 32 bits, so
+ * buffers stop at 4 GB. */
+static int buffer_reserve(struct bkd_buffer * b, uint64_t extra) {
+    uint64_t needed = (uint64_t) b->string.length + extra, capacity;
+    uint8_t * data;
+    if (needed <= b->capacity)
+        return 0;
+    if (needed > UINT32_MAX)
+        return compact_oom();
+    capacity = b->capacity ? 2 * (uint64_t) b->capacity : 4096;
+    if (capacity < needed) capacity = needed;
+    if (capacity > UINT32_MAX) capacity = UINT32_MAX;
+    if (!(data = BKD_REALLOC(b->string.data, capacity)))
+        return compact_oom();
+    b->string.data = data;
+    b->capacity = capacity;
+    return 0;
+}
+
+static void buffer_append(struct bkd_buffer * b, struct bkd_string string) {
+    if (string.length == 0)
+        return;
+    memcpy(b->string.data + b->string.length, string.data, string.length);
+    b->string.length += string.length;
+}
+
+/* Adds a node with no text and returns its id, or 0 on failure. */
+static uint32_t compact_push(struct bkd_compact * c, uint8_t kind, uint32_t flags) {
+    uint32_t id = c->count;
+    if (id == c->capacity && compact_resize(c, c->capacity ? 2 * c->capacity : 64))
+        return 0;
+    c->kinds[id] = kind;
+    c->flags[id] = flags;
+    c->next[id] = id + 1;
+    c->dataIds[id] = 0;
+    c->textStarts[id + 1] = c->text.string.length;
+    c->spanStarts[id + 1] = c->spanCount;
+    c->count++;
+    return id;
+}
+
+/* Text must be set before the next node is pushed. */
+static int compact_settext(struct bkd_compact * c, uint32_t id, struct bkd_string text) {
+    int error;
+    if (!text.length) return 0;
+    if ((error = buffer_reserve(&c->text, text.length)))
+        return error;
+    buffer_append(&c->text, text);
+    c->textStarts[id + 1] = c->text.string.length;
+    return 0;
+}
+
+/* Data strings repeat a lot, so the last one seen for each hash is reused
+ * when it matches. Puts the data id in id, which is 0 for no data. */
+static int compact_data(struct bkd_compact * c, struct bkd_string data, uint32_t * id) {
+    uint32_t * slot, d, start, capacity;
+    void * p;
+    int error;
+    *id = 0;
+    if (!data.length) return 0;
+    slot = c->dataCache + (bkd_strhash(data) & (COMPACT_CACHESLOTS - 1));
+    if ((d = *slot)) {
+        start = c->dataStarts[d - 1];
+        if (c->dataStarts[d] - start == data.length &&
+                !memcmp(c->data.string.data + start, data.data, data.length)) {
+            *id = d;
+            return 0;
+        }
+    }
+    if (c->dataCount + 1 >= c->dataCapacity) {
+        capacity = c->dataCapacity ? 2 * c->dataCapacity : 64;
+        if (!(p = BKD_REALLOC(c->dataStarts, capacity * sizeof(uint32_t))))
+            return compact_oom();
+        if (!c->dataStarts)
+            ((uint32_t *) p)[0] = 0;
+        c->dataStarts = p;
+        c->dataCapacity = capacity;
+    }
+    if ((error = buffer_reserve(&c->data, data.length)))
+        return error;
+    buffer_append(&c->data, data);
+    d = ++c->dataCount;
+    c->dataStarts[d] = c->data.string.length;
+    *id = *slot = d;
+    return 0;
+}
+
+static int compact_reservespans(struct bkd_compact * c, uint64_t extra) {
+    uint64_t needed = (uint64_t) c->spanCount + extra, capacity;
+    void * p;
+    if (needed <= c->spanCapacity)
+        return 0;
+    if (needed > UINT32_MAX)
+        return compact_oom();
+    capacity = c->spanCapacity ? 2 * (uint64_t) c->spanCapacity : 64;
+    if (capacity < needed) capacity = needed;
+    if (capacity > UINT32_MAX) capacity = UINT32_MAX;
+    if (!(p = BKD_REALLOC(c->spans, capacity * sizeof(struct bkd_span))))
+        return compact_oom();
+    c->spans = p;
+    c->spanCapacity = capacity;
+    return 0;
+}
+
+/* Gets the line and items of a block node, and what goes in its flags. */
+static int node_parts(const struct bkd_node * node, const struct bkd_linenode ** line,
+        const struct bkd_node ** items, uint32_t * itemCount, uint32_t * flags) {
+    *line = NULL;
+    *items = NULL;
+    *itemCount = 0;
+    *flags = 0;
+    switch (node->type) {
+        case BKD_PARAGRAPH: *line = &node->data.paragraph.text; break;
+        case BKD_COMMENTBLOCK: *line = &node->data.commentblock.text; break;
+        case BKD_TEXT: *line = &node->data.text; break;
+        case BKD_HEADER:
+            *line = &node->data.header.text;
+            *flags = node->data.header.size;
+            break;
+        case BKD_LIST:
+            *items = node->data.list.items;
+            *itemCount = node->data.list.itemCount;
+            *flags = node->data.list.style;
+            break;
+        case BKD_TABLE:
+            *items = node->data.table.items;
+            *itemCount = node->data.table.itemCount;
+            *flags = node->data.table.cols;
+            break;
+        case BKD_HORIZONTALRULE: *flags = node->data.linebreak.style; break;
+        case BKD_CODEBLOCK:
+        case BKD_DATASTRING:
+            break;
+        default:
+            BKD_ERROR(BKD_ERROR_UNKNOWN_NODE);
+            return BKD_ERROR_UNKNOWN_NODE;
+    }
+    return 0;
+}
+
+/* Where the line being copied started, and the innermost span open in it. */
+struct compact_line {
+    uint32_t id;
+    uint32_t textStart;
+    uint32_t spanStart;
+    uint32_t open;
+};
+
+/* Adds the text of l to the current line, and opens a span for it if it
+ * has markup. */
+static int compact_enterline(struct bkd_compact * c, struct compact_line * line,
+        const struct bkd_linenode * l) {
+    uint32_t markup = l->markup & BKD_MARKUP_MASK;
+    struct bkd_span * span;
+    int error;
+    if (markup) {
+        if ((error = compact_reservespans(c, 1)))
+            return error;
+        span = c->spans + c->spanCount;
+        span->start = c->text.string.length - line->textStart;
+        span->markup = markup;
+        span->parent = line->open;
+        line->open = c->spanCount++ - line->spanStart;
+        if ((error = compact_data(c, l->data, &span->data)))
+            return error;
+    }
+    if (l->nodeCount == 0) {
+        if ((error = buffer_reserve(&c->text, l->tree.leaf.length)))
+            return error;
+        buffer_append(&c->text, l->tree.leaf);
+    }
+    return 0;
+}
+
+/* Closes the span of l, if it has one. */
+static void compact_leaveline(struct bkd_compact * c, struct compact_line * line,
+        const struct bkd_linenode * l) {
+    struct bkd_span * span;
+    if (l->markup & BKD_MARKUP_MASK) {
+        span = c->spans + line->spanStart + line->open;
+        span->end = c->text.string.length - line->textStart;
+        span->last = c->spanCount - 1 - line->spanStart;
+        line->open = span->parent;
+    }
+}
+
+/* Copies a block node and its contents. While a block is open, its next
+ * holds the id of its parent, so that the walk needs no stack of its own. */
+static int compact_enter(struct bkd_compact * c, const struct bkd_node * node, uint32_t * current) {
+    const struct bkd_node * items;
+    const struct bkd_linenode * line;
+    uint32_t id, flags, itemCount;
+    int error;
+    if ((error = node_parts(node, &line, &items, &itemCount, &flags)))
+        return error;
+    if (!(id = compact_push(c, node->type, flags)))
+        return BKD_ERROR_OUT_OF_MEMORY;
+    c->next[id] = *current;
+    *current = id;
+    if (node->type == BKD_CODEBLOCK) {
+        if ((error = compact_data(c, node->data.codeblock.language, c->dataIds + id)))
+            return error;
+        return compact_settext(c, id, node->data.codeblock.text);
+    }
+    if (node->type == BKD_DATASTRING)
+        return compact_settext(c, id, node->data.datastring);
+    return 0;
+}
+
+static int compact_node(struct bkd_compact * c, const struct bkd_node * node) {
+    struct bkd_walk walk;
+    struct bkd_walkframe * f;
+    struct compact_line line = {0, 0, 0, BKD_SPAN_NONE};
+    uint32_t current = 0, parent;
+    int event, error = 0;
+    bkd_walk_init(&walk, node, 1);
+    while (!error && (event = bkd_walk_next(&walk))) {
+        f = bkd_walk_top(&walk);
+        if (!f->line) {
+            if (event & BKD_WALK_ENTER)
+                error = compact_enter(c, f->node, &current);
+            if (!error && (event & BKD_WALK_LEAVE)) {
+                parent = c->next[current];
+                c->next[current] = c->count;
+                current = parent;
+            }
+            continue;
+        }
+        /* The line node right under a block is the root of its text */
+        if ((event & BKD_WALK_ENTER) && f[-1].node) {
+            if (!(line.id = compact_push(c, BKD_COMPACT_LINE, 0))) {
+                error = BKD_ERROR_OUT_OF_MEMORY;
+                break;
+            }
+            line.textStart = c->text.string.length;
+            line.spanStart = c->spanCount;
+            line.open = BKD_SPAN_NONE;
+        }
+        if ((event & BKD_WALK_ENTER) && (error = compact_enterline(c, &line, f->line)))
+            break;
+        if (event & BKD_WALK_LEAVE) {
+            compact_leaveline(c, &line, f->line);
+            if (f[-1].node) {
+                c->textStarts[line.id + 1] = c->text.string.length;
+                c->spanStarts[line.id + 1] = c->spanCount;
+            }
+        }
+    }
+    if (!error)
+        error = walk.error;
+    bkd_walk_free(&walk);
+    /* Close whatever an error left open */
+    while (current) {
+        parent = c->next[current];
+        c->next[current] = c->count;
+        current = parent;
+    }
+    return error;
+}
+
+/* Counts the nodes, spans and text bytes that a compact copy needs. */
+struct compact_size {
+    uint64_t nodes;
+    uint64_t spans;
+    uint64_t text;
+};
+
+static void count_nodes(const struct bkd_node * items, uint32_t count, struct compact_size * size) {
+    struct bkd_walk walk;
+    struct bkd_walkframe * f;
+    int event;
+    bkd_walk_init(&walk, items, count);
+    while ((event = bkd_walk_next(&walk))) {
+        if (!(event & BKD_WALK_ENTER))
+            continue;
+        f = bkd_walk_top(&walk);
+        if (f->line) {
+            /* A line node right under a block is a compact line */
+            if (f[-1].node)
+                size->nodes++;
+            if (f->line->markup & BKD_MARKUP_MASK)
+                size->spans++;
+            if (f->line->nodeCount == 0)
+                size->text += f->line->tree.leaf.length;
+            continue;
+        }
+        size->nodes++;
+        if (f->node->type == BKD_CODEBLOCK)
+            size->text += f->node->data.codeblock.text.length;
+        else if (f->node->type == BKD_DATASTRING)
+            size->text += f->node->data.datastring.length;
+    }
+    bkd_walk_free(&walk);
+}
+
+int bkd_compact_init(struct bkd_compact * compact, uint32_t style) {
+    memset(compact, 0, sizeof(*compact));
+    if (compact_resize(compact, 64))
+        return BKD_ERROR_OUT_OF_MEMORY;
+    compact->textStarts[0] = 0;
+    compact->spanStarts[0] = 0;
+    compact_push(compact, BKD_LIST, style);
+    return 0;
+}
+
+int bkd_compact_append(struct bkd_compact * compact, const struct bkd_node * node) {
+    int error = compact_node(compact, node);
+    compact->next[0] = compact->count;
+    return error;
+}
+
+int bkd_compact_shrink(struct bkd_compact * compact) {
+    void * p;
+    int error;
+    if ((error = compact_resize(compact, compact->count)))
+        return error;
+    if (compact->spanCount < compact->spanCapacity && compact->spanCount) {
+        if (!(p = BKD_REALLOC(compact->spans, compact->spanCount * sizeof(struct bkd_span))))
+            return compact_oom();
+        compact->spans = p;
+        compact->spanCapacity = compact->spanCount;
+    }
+    if (compact->text.string.length < compact->text.capacity && compact->text.string.length) {
+        if (!(p = BKD_REALLOC(compact->text.string.data, compact->text.string.length)))
+            return compact_oom();
+        compact->text.string.data = p;
+        compact->text.capacity = compact->text.string.length;
+    }
+    if (compact->dataCount + 1 < compact->dataCapacity) {
+        if (!(p = BKD_REALLOC(compact->dataStarts, (compact->dataCount + 1) * sizeof(uint32_t))))
+            return compact_oom();
+        compact->dataStarts = p;
+        compact->dataCapacity = compact->dataCount + 1;
+    }
+    if (compact->data.string.length < compact->data.capacity && compact->data.string.length) {
+        if (!(p = BKD_REALLOC(compact->data.string.data, compact->data.string.length)))
+            return compact_oom();
+        compact->data.string.data = p;
+        compact->data.capacity = compact->data.string.length;
+    }
+    return 0;
+}
+
+int bkd_compact_new(struct bkd_compact * compact, const struct bkd_list * document) {
+    struct compact_size size = {1, 0, 0};
+    int error;
+    count_nodes(document->items, document->itemCount, &size);
+    if (size.nodes > UINT32_MAX - 1)
+        return compact_oom();
+    if ((error = bkd_compact_init(compact, document->style)))
+        return error;
+    if ((error = compact_resize(compact, size.nodes)) ||
+            (error = compact_reservespans(compact, size.spans)) ||
+            (error = buffer_reserve(&compact->text, size.text)))
+        goto fail;
+    for (uint32_t i = 0; i < document->itemCount; i++)
+        if ((error = bkd_compact_append(compact, document->items + i)))
+            goto fail;
+    if ((error = bkd_compact_shrink(compact)))
+        goto fail;
+    return 0;
+fail:
+    bkd_compact_free(compact);
+    return error;
+}
+
+void bkd_compact_free(struct bkd_compact * compact) {
+    BKD_FREE(compact->kinds);
+    BKD_FREE(compact->flags);
+    BKD_FREE(compact->next);
+    BKD_FREE(compact->textStarts);
+    BKD_FREE(compact->spanStarts);
+    BKD_FREE(compact->spans);
+    BKD_FREE(compact->dataIds);
+    BKD_FREE(compact->text.string.data);
+    BKD_FREE(compact->dataStarts);
+    BKD_FREE(compact->data.string.data);
+    memset(compact, 0, sizeof(*compact));
+}
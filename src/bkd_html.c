@@ -22,355 +22,979 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "bkd.h"
 #include "bkd_html.h"
 #include "bkd_utf8.h"
+#include "bkd_scan.h"
 
-/* Use numeric escapes for most things for easier generation */
-static size_t html_escape_utf8(uint32_t point, uint8_t buffer[12]) {
-    static const uint8_t hexDigits[] = {
-        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B' ,'C', 'D', 'E', 'F'
-    };
-    uint8_t digitStack[12];
-    uint32_t digitsTop = 0;
-    uint32_t len = 3;
-    buffer[0] = '&';
-    buffer[1] = '#';
-    buffer[2] = 'x';
-    while (point > 0) {
-        digitStack[digitsTop++] = hexDigits[point % 16];
-        point /= 16;
-    }
-    while (digitsTop > 0) {
-        buffer[len++] = digitStack[--digitsTop];
+#include <string.h>
+
+/* Use numeric escapes for most things for easier generation. Escapes for
+ * ASCII come from a table. NUL has no character of its own in HTML, so it
+ * is written as the replacement character. */
+#define ENT(C, S) [C] = {sizeof(S) - 1, S}
+
+static const struct {
+    uint8_t length;
+    char data[9];
+} html_entities[128] = {
+    ENT(0x00, "&#xFFFD;"), ENT(0x01, "&#x1;"), ENT(0x02, "&#x2;"), ENT(0x03, "&#x3;"),
+    ENT(0x04, "&#x4;"), ENT(0x05, "&#x5;"), ENT(0x06, "&#x6;"), ENT(0x07, "&#x7;"),
+    ENT(0x08, "&#x8;"), ENT(0x09, "&#x9;"), ENT(0x0A, "&#xA;"), ENT(0x0B, "&#xB;"),
+    ENT(0x0C, "&#xC;"), ENT(0x0D, "&#xD;"), ENT(0x0E, "&#xE;"), ENT(0x0F, "&#xF;"),
+    ENT(0x10, "&#x10;"), ENT(0x11, "&#x11;"), ENT(0x12, "&#x12;"), ENT(0x13, "&#x13;"),
+    ENT(0x14, "&#x14;"), ENT(0x15, "&#x15;"), ENT(0x16, "&#x16;"), ENT(0x17, "&#x17;"),
+    ENT(0x18, "&#x18;"), ENT(0x19, "&#x19;"), ENT(0x1A, "&#x1A;"), ENT(0x1B, "&#x1B;"),
+    ENT(0x1C, "&#x1C;"), ENT(0x1D, "&#x1D;"), ENT(0x1E, "&#x1E;"), ENT(0x1F, "&#x1F;"),
+    ENT('"', "&#x22;"), ENT('&', "&#x26;"), ENT('\'', "&#x27;"),
+    ENT('<', "&#x3C;"), ENT('>', "&#x3E;")
+};
+
+#undef ENT
+
+/* Two hex digits for every byte */
+static const char html_hexpairs[] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/* Escapes a codepoint past ASCII in the basic multilingual plane. */
+static size_t html_escape_bmp(uint32_t point, uint8_t buffer[12]) {
+    uint8_t digits[4];
+    uint32_t count = point < 0x100 ? 2 : point < 0x1000 ? 3 : 4;
+    memcpy(digits, html_hexpairs + 2 * (point >> 8), 2);
+    memcpy(digits + 2, html_hexpairs + 2 * (point & 0xFF), 2);
+    memcpy(buffer, "&#x", 3);
+    memcpy(buffer + 3, digits + 4 - count, count);
+    buffer[3 + count] = ';';
+    return count + 4;
+}
+
+static const uint64_t
+    htmlflag_newline = 1 << 0,
+    htmlflag_raw = 1 << 1;
+
+/* Writes one codepoint. Past ASCII, codepoints in the basic multilingual
+ * plane are escaped unless htmlflag_raw is set. */
+static size_t html_write_utf8(uint32_t point, uint32_t flags, uint8_t buffer[12]) {
+    if (point < 0x80) {
+        if (!html_entities[point].length) {
+            buffer[0] = (uint8_t) point;
+            return 1;
+        }
+        memcpy(buffer, html_entities[point].data, html_entities[point].length);
+        return html_entities[point].length;
     }
-    buffer[len++] = ';';
-    return len;
+    if (point < 0x10000 && !(flags & htmlflag_raw))
+        return html_escape_bmp(point, buffer);
+    return bkd_utf8_write(buffer, point);
 }
 
-static size_t html_write_utf8(uint32_t point, uint8_t buffer[12]) {
-    if (point == 60 || point == 62 || point == 38 || point == 34 || point == 39 ||
-            point < 32 ||
-            (point > 127 && point < 0x10000)) {
-        return html_escape_utf8(point, buffer);
-    } else {
-        return bkd_utf8_write(buffer, point);
+/* Writes one escaped codepoint. Needs at most 12 bytes. */
+static size_t html_write_text(uint32_t point, uint32_t flags, uint8_t buffer[12]) {
+    if (point == '\n' && (flags & htmlflag_newline)) {
+        memcpy(buffer, "<br>", 4);
+        return 4;
     }
+    return html_write_utf8(point, flags, buffer);
 }
 
-static const uint64_t
-    htmlflag_newline = 1 << 0;
-
-#define CASE(codepoint, flag, string) case codepoint: if (flags & (flag)) { bkd_puts(out, string); continue; } break;
-
-static void print_html_utf8(struct bkd_ostream * out, struct bkd_string string, uint64_t flags) {
-    uint8_t buffer[12];
-    uint32_t codepoint;
-    uint32_t pos = 0;
-    while (pos < string.length) {
-        pos += bkd_utf8_read(string.data + pos, &codepoint);
-        switch (codepoint) {
-            CASE('\n', htmlflag_newline, "<br>")
-            default:
-                break;
+/* Same test as bkd_scan_html, or bkd_scan_htmlascii with htmlflag_raw, for
+ * one byte. */
+static inline int html_special(uint8_t c, uint32_t flags) {
+    return c < 0x20 || (c >= 0x80 && !(flags & htmlflag_raw)) ||
+        c == '<' || c == '>' || c == '&' || c == '"' || c == '\'';
+}
+
+/* Reads one character past ASCII. Characters that are plainly well formed
+ * are decoded here, anything else by bkd_utf8_readlen, which also replaces
+ * invalid bytes. */
+static inline uint32_t html_read_utf8(const uint8_t * s, uint32_t length, uint32_t * codepoint) {
+    uint32_t value;
+    if (s[0] >= 0xC2 && s[0] < 0xE0 && length >= 2 && (s[1] & 0xC0) == 0x80) {
+        *codepoint = ((uint32_t) (s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+        return 2;
+    }
+    if (s[0] > 0xE0 && s[0] < 0xF0 && s[0] != 0xED && length >= 3 &&
+            (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80) {
+        *codepoint = ((uint32_t) (s[0] & 0x0F) << 12) | ((uint32_t) (s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        return 3;
+    }
+    if (s[0] >= 0xF0 && s[0] < 0xF5 && length >= 4 &&
+            (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80 && (s[3] & 0xC0) == 0x80) {
+        value = ((uint32_t) (s[0] & 0x07) << 18) | ((uint32_t) (s[1] & 0x3F) << 12) |
+            ((uint32_t) (s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        if (value >= 0x10000 && value <= BKD_UTF8_MAXCODEPOINT) {
+            *codepoint = value;
+            return 4;
         }
-        size_t len = html_write_utf8(codepoint, buffer);
-        struct bkd_string bufferstring = {
-            len,
-            buffer
-        };
-        bkd_putn(out, bufferstring);
     }
+    return bkd_utf8_readlen((uint8_t *) s, codepoint, length);
 }
 
-#undef CASE
+/* Plain bytes after a character past ASCII that are copied one at a time
+ * before escaping goes back to the scanner. Text past ASCII often has a
+ * space or a letter or two between its characters, which is not worth a
+ * scan. */
+#define HTML_PLAINRUN 8
 
-/* Allows escaping of elements like </script> and </style>, which
- * are potential points for cross site scripting attacks.
- * TODO: Possibly replace with KNP algorithm although since </script>
- * and </style> have no repeat characters it is not much needed (yet).
- */
-static void print_escape_sequence_no_repeat(
-        struct bkd_ostream * out,
-        struct bkd_string string,
-        struct bkd_string avoid,
-        struct bkd_string replace) {
-    /* Avoid MUST be less than 12 characters AND have no repeating characters. */
-    uint8_t bufferData[12];
-    struct bkd_string buffer;
-    buffer.data = bufferData;
-    buffer.length = 0;
-    const uint8_t *stringEnd = string.data + string.length;
-    for (uint8_t * c = string.data; c < stringEnd; ++c) {
-        if (*c == avoid.data[buffer.length]) {
-            buffer.data[buffer.length++] = *c;
-            if (buffer.length == avoid.length) {
-                bkd_putn(out, replace);
-                buffer.length = 0;
+/* Escapes as much of text as fits in room bytes of out. Runs that need no
+ * escaping are found by the scanner and copied whole, and the characters
+ * that stop it are escaped one at a time. Text past ASCII is handled a
+ * character at a time, along with short plain runs inside it, so it is not
+ * handed back to the scanner for every character. Stops before a character
+ * whose escape might not fit. Sets written and returns how much of text was
+ * used. */
+static uint32_t html_escape_into(struct bkd_string text, uint32_t flags,
+        uint8_t * out, uint32_t room, uint32_t * written) {
+    uint32_t pos = 0, n = 0, run, limit, codepoint, plain;
+    uint32_t (*scan)(const uint8_t *, uint32_t) = (flags & htmlflag_raw) ? bkd_scan_htmlascii : bkd_scan_html;
+    uint8_t c;
+    while (pos < text.length) {
+        /* Only scan as far as fits, or long texts get rescanned for every chunk. */
+        limit = text.length - pos;
+        if (limit > room - n)
+            limit = room - n;
+        run = html_special(text.data[pos], flags) ? 0 : scan(text.data + pos, limit);
+        memcpy(out + n, text.data + pos, run);
+        n += run;
+        pos += run;
+        for (plain = 0; pos < text.length && room - n >= 12; ) {
+            c = text.data[pos];
+            if (!html_special(c, flags)) {
+                if (!plain)
+                    break;
+                out[n++] = c;
+                pos++;
+                plain--;
+            } else if (c < 0x80) {
+                pos++;
+                n += html_write_text(c, flags, out + n);
+            } else {
+                pos += html_read_utf8(text.data + pos, text.length - pos, &codepoint);
+                n += html_write_utf8(codepoint, flags, out + n);
+                plain = HTML_PLAINRUN;
             }
-        } else {
-            bkd_putn(out, buffer);
-            buffer.length = 0;
-            bkd_putc(out, *c);
         }
+        if (pos == text.length || room - n < 12)
+            break;
     }
-    /* Print remaining characters */
-    bkd_putn(out, buffer);
+    *written = n;
+    return pos;
 }
 
-/* Similar to print_escape_sequence_no_repeate, but takes stream instead
- * of string. The avoid string also can't contain newlines. */
-static void print_escape_stream(
-        struct bkd_ostream * out,
-        struct bkd_istream * in,
-        struct bkd_string avoid,
-        struct bkd_string replace) {
-    while (!in->done) {
-        struct bkd_string line = bkd_getl(in);
-        print_escape_sequence_no_repeat(out, line, avoid, replace);
-        bkd_putc(out, '\n');
-        bkd_putc(out, '\r');
-    }
-}
+/* Private options for rendering only the part of a document before or
+ * after the body. */
+#define HTML_NOHEAD 0x40000000
+#define HTML_NOTAIL 0x80000000
 
-static void print_line(struct bkd_ostream * out, struct bkd_linenode * t);
+/* String literals with their lengths */
+#define LIT(S) {sizeof(S) - 1, (uint8_t *) (S)}
 
-static void print_codeinline(struct bkd_ostream * out, struct bkd_linenode * t) {
-    uint32_t i;
-    if (t->markup & BKD_CODEINLINE) bkd_puts(out, "<code>");
-    if (t->nodeCount > 0) {
-        for (i = 0; i < t->nodeCount; i++) {
-            print_line(out, t->tree.node + i);
-        }
-    } else {
-        print_html_utf8(out, t->tree.leaf, 1);
-    }
-    if (t->markup & BKD_CODEINLINE) bkd_puts(out, "</code>");
+static const struct bkd_string
+    lit_doctype = LIT("<!DOCTYPE html><html><head><meta charset=\"UTF-8\">"),
+    lit_headend = LIT("</head><body>"),
+    lit_docend = LIT("</body></html>\n"),
+    lit_stylelink = LIT("<link rel=\"stylesheet\" type=\"text/css\" href=\""),
+    lit_stylelinkend = LIT("\">"),
+    lit_style = LIT("<style>"),
+    lit_styleend = LIT("</style>"),
+    lit_scriptlink = LIT("<script type=\"text/javascript\" src=\""),
+    lit_scriptlinkend = LIT("\"></script>"),
+    lit_script = LIT("<script type=\"text/javascript\">"),
+    lit_scriptend = LIT("</script>"),
+    lit_rawnewline = LIT("\n\r"),
+    lit_p = LIT("<p>"),
+    lit_pend = LIT("</p>"),
+    lit_blockquote = LIT("<blockquote>"),
+    lit_blockquoteend = LIT("</blockquote>"),
+    lit_li = LIT("<li>"),
+    lit_liend = LIT("</li>"),
+    lit_table = LIT("<table>"),
+    lit_tableend = LIT("</table>"),
+    lit_tr = LIT("<tr>"),
+    lit_trend = LIT("</tr>"),
+    lit_td = LIT("<td>"),
+    lit_tdend = LIT("</td>"),
+    lit_hrdotted = LIT("<hr class=\"bkd-dotted\">"),
+    lit_hrsolid = LIT("<hr class=\"bkd-solid\">"),
+    lit_codeblocklang = LIT("<pre><code data-bkd-language=\""),
+    lit_codeblocklangend = LIT("\">"),
+    lit_codeblock = LIT("<pre><code>"),
+    lit_codeblockend = LIT("</code></pre>"),
+    lit_datastring = LIT("<div hidden class=\"bkd-datastring\">"),
+    lit_datastringend = LIT("</div>"),
+    lit_img = LIT("<img src=\""),
+    lit_imgend = LIT("\"></img>"),
+    lit_code = LIT("<code>"),
+    lit_codeend = LIT("</code>"),
+    lit_empty = LIT("");
+
+/* Opening and closing tags for each list style. Styles without tags still
+ * get list items. */
+static const struct {
+    struct bkd_string open;
+    struct bkd_string close;
+    int wrap;
+} list_tags[] = {
+    {LIT("<div class=\"bkd-subdoc\">"), LIT("</div>"), 0},
+    {LIT("<ol type=\"1\" class=\"bkd-list-numbered\">"), LIT("</ol>"), 1},
+    {LIT("<ul class=\"bkd-list-bullets\">"), LIT("</ul>"), 1},
+    {LIT("<ol type=\"A\" class=\"bkd-list-alpha\">"), LIT("</ol>"), 1},
+    {LIT("<ol type=\"I\" class=\"bkd-list-roman\">"), LIT("</ol>"), 1},
+    {LIT(""), LIT(""), 1},
+    {LIT(""), LIT(""), 1}
+};
+
+/* Markups that wrap a line node, from outermost to innermost. Markups with
+ * data print it inside the opening tag. Images and inline code are handled
+ * after these. */
+#define MARKUP_NEEDSDATA 1
+#define MARKUP_HASDATA 2
+#define MARKUP_DATANEWLINES 4
+#define MARKUP_STYLES 8
+
+/* The plain style markups, which nest bold, italics, strikethrough,
+ * subscript, superscript and underline from outermost to innermost. Every
+ * combination has its open and close sequence spelled out, indexed by
+ * markup_style. */
+#define MARKUP_STYLEBITS (BKD_BOLD | BKD_ITALICS | BKD_STRIKETHROUGH | \
+    BKD_SUBSCRIPT | BKD_SUPERSCRIPT | BKD_UNDERLINE)
+#define markup_style(M) (((M) & 7) | (((M) >> 4) & 0x18) | (((M) & BKD_UNDERLINE) << 2))
+
+#define STYLE_OPENB0 ""
+#define STYLE_OPENB1 "<strong>"
+#define STYLE_OPENI0 ""
+#define STYLE_OPENI1 "<em>"
+#define STYLE_OPENK0 ""
+#define STYLE_OPENK1 "<del>"
+#define STYLE_OPENS0 ""
+#define STYLE_OPENS1 "<sub>"
+#define STYLE_OPENP0 ""
+#define STYLE_OPENP1 "<sup>"
+#define STYLE_OPENU0 ""
+#define STYLE_OPENU1 "<u>"
+#define STYLE_CLOSEB0 ""
+#define STYLE_CLOSEB1 "</strong>"
+#define STYLE_CLOSEI0 ""
+#define STYLE_CLOSEI1 "</em>"
+#define STYLE_CLOSEK0 ""
+#define STYLE_CLOSEK1 "</del>"
+#define STYLE_CLOSES0 ""
+#define STYLE_CLOSES1 "</sub>"
+#define STYLE_CLOSEP0 ""
+#define STYLE_CLOSEP1 "</sup>"
+#define STYLE_CLOSEU0 ""
+#define STYLE_CLOSEU1 "</u>"
+
+#define STYLE(u, p, s, k, i, b) { \
+    LIT(STYLE_OPENB##b STYLE_OPENI##i STYLE_OPENK##k STYLE_OPENS##s STYLE_OPENP##p STYLE_OPENU##u), \
+    LIT(STYLE_CLOSEU##u STYLE_CLOSEP##p STYLE_CLOSES##s STYLE_CLOSEK##k STYLE_CLOSEI##i STYLE_CLOSEB##b)}
+#define STYLES1(u, p, s, k, i) STYLE(u, p, s, k, i, 0), STYLE(u, p, s, k, i, 1)
+#define STYLES2(u, p, s, k) STYLES1(u, p, s, k, 0), STYLES1(u, p, s, k, 1)
+#define STYLES3(u, p, s) STYLES2(u, p, s, 0), STYLES2(u, p, s, 1)
+#define STYLES4(u, p) STYLES3(u, p, 0), STYLES3(u, p, 1)
+#define STYLES5(u) STYLES4(u, 0), STYLES4(u, 1)
+
+static const struct {
+    struct bkd_string open;
+    struct bkd_string close;
+} markup_styles[64] = {STYLES5(0), STYLES5(1)};
+
+static const struct {
+    uint32_t markup;
+    uint32_t flags;
+    struct bkd_string open;
+    struct bkd_string openEnd;
+    struct bkd_string close;
+} markup_tags[] = {
+    {BKD_CUSTOM, MARKUP_NEEDSDATA | MARKUP_HASDATA, LIT("<span class=\"bkd-custom-"), LIT("\">"), LIT("</span>")},
+    {BKD_ANCHOR, MARKUP_NEEDSDATA | MARKUP_HASDATA, LIT("<a id=\""), LIT("\">"), LIT("</a>")},
+    {BKD_INTERNALLINK, MARKUP_NEEDSDATA | MARKUP_HASDATA, LIT("<a href=\"#"), LIT("\">"), LIT("</a>")},
+    {MARKUP_STYLEBITS, MARKUP_STYLES, LIT(""), LIT(""), LIT("")},
+    {BKD_LINK, MARKUP_HASDATA | MARKUP_DATANEWLINES, LIT("<a href=\""), LIT("\">"), LIT("</a>")}
+};
+
+#define MARKUP_TAGCOUNT (sizeof(markup_tags) / sizeof(markup_tags[0]))
+
+static struct bkd_string markup_open(uint32_t markup, uint32_t i) {
+    if (markup_tags[i].flags & MARKUP_STYLES)
+        return markup_styles[markup_style(markup)].open;
+    return markup_tags[i].open;
 }
 
-static void print_image(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if (t->markup & BKD_IMAGE) {
-        bkd_puts(out, "<img src=\"");
-        print_html_utf8(out, t->data, 0);
-        bkd_puts(out, "\"></img>");
-    } else {
-        return print_codeinline(out, t);
+static struct bkd_string markup_close(uint32_t markup, uint32_t i) {
+    if (markup_tags[i].flags & MARKUP_STYLES)
+        return markup_styles[markup_style(markup)].close;
+    return markup_tags[i].close;
+}
+
+#undef LIT
+
+static uint8_t styleStringData[] = "</style>";
+static struct bkd_string styleString = {8, styleStringData};
+
+static uint8_t styleStringReplaceData[] = "<\\/style>";
+static struct bkd_string styleStringReplace = {9, styleStringReplaceData};
+
+static uint8_t scriptStringData[] = "</script>";
+static struct bkd_string scriptString = {9, scriptStringData};
+
+static uint8_t scriptStringReplaceData[] = "<\\/script>";
+static struct bkd_string scriptStringReplace = {10, scriptStringReplaceData};
+
+/*
+ * Render cursor
+ *
+ * The document is walked with an explicit stack of frames. Each step of a
+ * frame emits at most one piece of output: a literal, a string to escape, or
+ * an inserted script or style to copy. Whatever does not fit in the caller's
+ * buffer is kept in pending, which always points at memory that outlives the
+ * call (literals, the document, or the cursor's scratch space).
+ */
+
+#define FRAME_DOC 0
+#define FRAME_NODE 1
+#define FRAME_LINE 2
+
+/* Phases of a line frame */
+#define LINE_OPEN 0
+#define LINE_OPENDATA 1
+#define LINE_OPENEND 2
+#define LINE_IMAGE 3
+#define LINE_IMAGEDATA 4
+#define LINE_IMAGEEND 5
+#define LINE_CODE 6
+#define LINE_CONTENT 7
+#define LINE_CODEEND 8
+#define LINE_CLOSE 9
+
+#define cursor_stack(C) ((C)->heapFrames ? (C)->heapFrames : (C)->frames)
+
+/* Doubles the stack, moving it to the heap the first time. */
+static int cursor_grow(struct bkd_html_cursor * c) {
+    uint32_t capacity = 2 * c->stackCapacity;
+    struct bkd_html_frame * grown;
+    if (c->heapFrames) {
+        grown = BKD_REALLOC(c->heapFrames, capacity * sizeof(struct bkd_html_frame));
+    } else if ((grown = BKD_MALLOC(capacity * sizeof(struct bkd_html_frame)))) {
+        memcpy(grown, c->frames, sizeof(c->frames));
     }
+    if (!grown) {
+        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        c->error = BKD_ERROR_OUT_OF_MEMORY;
+        return 0;
+    }
+    c->heapFrames = grown;
+    c->stackCapacity = capacity;
+    return 1;
 }
 
-static void print_math(struct bkd_ostream * out, struct bkd_linenode * t) {
-    /* NYI */
-    return print_image(out, t);
+/* Pushes a frame, growing the stack when the document is deep. This may move
+ * the stack, so callers must not use their own frame afterwards. */
+static void cursor_push(struct bkd_html_cursor * c, uint8_t kind, void * item) {
+    struct bkd_html_frame * f;
+    if (c->stackCount == c->stackCapacity && !cursor_grow(c))
+        return;
+    f = cursor_stack(c) + c->stackCount++;
+    f->kind = kind;
+    f->phase = 0;
+    f->index = 0;
+    f->aux = 0;
+    f->item = item;
 }
 
-static void print_link(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if (t->markup & BKD_LINK) {
-        bkd_puts(out, "<a href=\"");
-        print_html_utf8(out, t->data, 1);
-        bkd_puts(out, "\">");
-        print_math(out, t);
-        bkd_puts(out, "</a>");
-    } else {
-        return print_math(out, t);
-    }
+static void cursor_reset(struct bkd_html_cursor * c) {
+    c->heapFrames = NULL;
+    c->stackCapacity = BKD_HTML_CURSOR_FRAMES;
+    for (uint32_t i = 0; i < BKD_HTML_ATTRCACHE_SLOTS; i++)
+        c->attrs[i].key = NULL;
+    c->stackCount = 0;
+    c->pending = BKD_NULLSTR;
+    c->textActive = 0;
+    c->rawActive = 0;
+    c->error = 0;
+    c->done = 0;
 }
 
-static void print_underline(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if (t->markup & BKD_UNDERLINE) bkd_puts(out, "<u>");
-    print_link(out, t);
-    if (t->markup & BKD_UNDERLINE) bkd_puts(out, "</u>");
+int bkd_html_cursor_init(
+        struct bkd_html_cursor * cursor,
+        struct bkd_list * document,
+        uint32_t options,
+        uint32_t insertCount,
+        struct bkd_htmlinsert * inserts) {
+    cursor_reset(cursor);
+    cursor->document = document;
+    cursor->options = options;
+    cursor->insertCount = insertCount;
+    cursor->inserts = inserts;
+    cursor_push(cursor, FRAME_DOC, document);
+    return 0;
 }
 
-static void print_superscript(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if (t->markup & BKD_SUPERSCRIPT) bkd_puts(out, "<sup>");
-    print_underline(out, t);
-    if (t->markup & BKD_SUPERSCRIPT) bkd_puts(out, "</sup>");
+int bkd_html_cursor_init_fragment(struct bkd_html_cursor * cursor, struct bkd_node * node) {
+    cursor_reset(cursor);
+    cursor->document = NULL;
+    cursor->options = 0;
+    cursor->insertCount = 0;
+    cursor->inserts = NULL;
+    cursor_push(cursor, FRAME_NODE, node);
+    return 0;
 }
 
-static void print_subscript(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if (t->markup & BKD_SUBSCRIPT) bkd_puts(out, "<sub>");
-    print_superscript(out, t);
-    if (t->markup & BKD_SUBSCRIPT) bkd_puts(out, "</sub>");
+void bkd_html_cursor_free(struct bkd_html_cursor * cursor) {
+    if (cursor->heapFrames)
+        BKD_FREE(cursor->heapFrames);
+    cursor->heapFrames = NULL;
 }
 
-static void print_strikethrough(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if (t->markup & BKD_STRIKETHROUGH) bkd_puts(out, "<del>");
-    print_subscript(out, t);
-    if (t->markup & BKD_STRIKETHROUGH) bkd_puts(out, "</del>");
+/* Copies as much of string as fits. The rest is left pending. */
+static void cursor_emit(struct bkd_html_cursor * c, struct bkd_string string) {
+    uint32_t n = string.length < c->room ? string.length : c->room;
+    memcpy(c->out, string.data, n);
+    c->out += n;
+    c->room -= n;
+    c->pending.data = string.data + n;
+    c->pending.length = string.length - n;
 }
 
-static void print_italics(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if (t->markup & BKD_ITALICS) bkd_puts(out, "<em>");
-    print_strikethrough(out, t);
-    if (t->markup & BKD_ITALICS) bkd_puts(out, "</em>");
+/* Text flags that come from the rendering options */
+#define cursor_textflags(C) (((C)->options & BKD_OPTION_RAWUTF8) ? htmlflag_raw : 0)
+
+static void cursor_text(struct bkd_html_cursor * c, struct bkd_string text, uint32_t flags) {
+    c->text = text;
+    c->textPos = 0;
+    c->textFlags = flags | cursor_textflags(c);
+    c->textActive = 1;
 }
 
-static void print_bold(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if (t->markup & BKD_BOLD) bkd_puts(out, "<strong>");
-    print_italics(out, t);
-    if (t->markup & BKD_BOLD) bkd_puts(out, "</strong>");
+/* Marks an attribute cache slot whose value is too long to keep. */
+#define ATTR_TOOLONG 0xFFFFFFFF
+
+/* Escapes an attribute value through the cache. */
+static void cursor_attr(struct bkd_html_cursor * c, struct bkd_string text, uint32_t flags) {
+    struct bkd_html_attrcache * slot;
+    uint32_t n;
+    if (text.length == 0) return;
+    flags |= cursor_textflags(c);
+    slot = c->attrs + ((((uint32_t) ((uintptr_t) text.data >> 3) * 2654435761u) >> 16) & (BKD_HTML_ATTRCACHE_SLOTS - 1));
+    if (slot->key != text.data || slot->keyLength != text.length || slot->flags != flags) {
+        slot->key = text.data;
+        slot->keyLength = text.length;
+        slot->flags = flags;
+        if (html_escape_into(text, flags, slot->data, BKD_HTML_ATTRCACHE_SIZE, &n) < text.length)
+            slot->length = ATTR_TOOLONG;
+        else
+            slot->length = n;
+    }
+    if (slot->length == ATTR_TOOLONG)
+        cursor_text(c, text, flags);
+    else
+        cursor_emit(c, (struct bkd_string) {slot->length, slot->data});
 }
 
-static void print_internallink(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if ((t->markup & BKD_INTERNALLINK) && t->data.length > 0) {
-        bkd_puts(out, "<a href=\"#");
-        print_html_utf8(out, t->data, 0);
-        bkd_puts(out, "\">");
-        print_bold(out, t);
-        bkd_puts(out, "</a>");
+static void cursor_raw(struct bkd_html_cursor * c, struct bkd_htmlinsert * insert,
+        struct bkd_string avoid, struct bkd_string replace) {
+    if (insert->type & BKD_HTML_INSERT_ISSTREAM) {
+        c->rawStream = insert->data.stream;
+        c->raw = BKD_NULLSTR;
     } else {
-        print_bold(out, t);
+        c->rawStream = NULL;
+        c->raw = insert->data.string;
     }
+    c->rawPos = 0;
+    c->rawMatched = 0;
+    c->rawNewline = 0;
+    c->rawForce = 0;
+    c->avoid = avoid;
+    c->replace = replace;
+    c->rawActive = 1;
 }
 
-static void print_anchor(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if ((t->markup & BKD_ANCHOR) && t->data.length > 0) {
-        bkd_puts(out, "<a id=\"");
-        print_html_utf8(out, t->data, 0);
-        bkd_puts(out, "\">");
-        print_internallink(out, t);
-        bkd_puts(out, "</a>");
-    } else {
-        print_internallink(out, t);
+/* Escapes text until it is done or the buffer is full. */
+static void cursor_step_text(struct bkd_html_cursor * c) {
+    uint32_t codepoint, written;
+    size_t len;
+    while (c->textPos < c->text.length) {
+        c->textPos += html_escape_into(
+                (struct bkd_string) {c->text.length - c->textPos, c->text.data + c->textPos},
+                c->textFlags, c->out, c->room, &written);
+        c->out += written;
+        c->room -= written;
+        if (c->textPos == c->text.length)
+            break;
+        /* Nearly out of room, so go on through scratch. Bytes that need no
+         * escape go one at a time, since a run may have stopped inside a
+         * character. */
+        if (html_special(c->text.data[c->textPos], c->textFlags)) {
+            c->textPos += bkd_utf8_readlen(c->text.data + c->textPos, &codepoint, c->text.length - c->textPos);
+            len = html_write_text(codepoint, c->textFlags, c->scratch);
+        } else {
+            c->scratch[0] = c->text.data[c->textPos++];
+            len = 1;
+        }
+        cursor_emit(c, (struct bkd_string) {len, c->scratch});
+        if (c->pending.length) return;
     }
+    c->textActive = 0;
 }
 
-static void print_line(struct bkd_ostream * out, struct bkd_linenode * t) {
-    if ((t->markup & BKD_CUSTOM) && t->data.length > 0) {
-        bkd_puts(out, "<span class=\"bkd-custom-");
-        print_html_utf8(out, t->data, 0);
-        bkd_puts(out, "\">");
-        print_anchor(out, t);
-        bkd_puts(out, "</span>");
-    } else {
-        print_anchor(out, t);
+/* Copies inserted text, replacing the avoided sequence. Streams are copied a
+ * line at a time, each line followed by a newline. Stops whenever something is
+ * left pending. */
+static void cursor_step_raw(struct bkd_html_cursor * c) {
+    uint8_t byte;
+    uint32_t n;
+    for (;;) {
+        if (c->rawPos >= c->raw.length) {
+            if (c->rawMatched) {
+                n = c->rawMatched;
+                c->rawMatched = 0;
+                cursor_emit(c, (struct bkd_string) {n, c->avoid.data});
+                return;
+            }
+            if (c->rawNewline) {
+                c->rawNewline = 0;
+                cursor_emit(c, lit_rawnewline);
+                return;
+            }
+            if (!c->rawStream || c->rawStream->done) {
+                c->rawActive = 0;
+                return;
+            }
+            c->raw = bkd_getl(c->rawStream);
+            c->rawPos = 0;
+            c->rawNewline = 1;
+            continue;
+        }
+        if (c->room == 0) return;
+        byte = c->raw.data[c->rawPos];
+        if (c->rawForce) {
+            c->rawForce = 0;
+        } else if (byte == c->avoid.data[c->rawMatched]) {
+            c->rawPos++;
+            if (++c->rawMatched == c->avoid.length) {
+                c->rawMatched = 0;
+                cursor_emit(c, c->replace);
+                return;
+            }
+            continue;
+        } else if (c->rawMatched) {
+            /* Flush the partial match, then copy this byte as is. */
+            n = c->rawMatched;
+            c->rawMatched = 0;
+            c->rawForce = 1;
+            cursor_emit(c, (struct bkd_string) {n, c->avoid.data});
+            return;
+        }
+        *c->out++ = byte;
+        c->room--;
+        c->rawPos++;
     }
 }
 
-static int32_t print_node(struct bkd_ostream * out, struct bkd_node * node) {
-    uint32_t headerSize;
-    uint32_t listWrap = 1;
+static void step_doc(struct bkd_html_cursor * c, struct bkd_html_frame * f) {
+    struct bkd_list * document = (struct bkd_list *) f->item;
+    struct bkd_htmlinsert * insert;
+    int standalone = c->options & BKD_OPTION_STANDALONE;
+    switch (f->phase) {
+        case 0:
+            if (c->options & HTML_NOHEAD) {
+                f->phase = 3;
+                break;
+            }
+            if (standalone)
+                cursor_emit(c, lit_doctype);
+            f->phase = 1;
+            break;
+        case 1: /* Inserts */
+            if (f->index >= c->insertCount) {
+                f->phase = 2;
+                break;
+            }
+            insert = c->inserts + f->index;
+            if (!(insert->type & (BKD_HTML_INSERTSTYLE | BKD_HTML_INSERTSCRIPT))) {
+                f->index++;
+                break;
+            }
+            if (insert->type & BKD_HTML_INSERT_ISLINK) {
+                int style = insert->type & BKD_HTML_INSERTSTYLE;
+                switch (f->aux++) {
+                    case 0: cursor_emit(c, style ? lit_stylelink : lit_scriptlink); break;
+                    case 1: cursor_text(c, insert->data.string, 0); break;
+                    default:
+                        cursor_emit(c, style ? lit_stylelinkend : lit_scriptlinkend);
+                        f->aux = 0;
+                        f->index++;
+                        break;
+                }
+            } else if (insert->type & BKD_HTML_INSERTSTYLE) {
+                switch (f->aux++) {
+                    case 0: cursor_emit(c, lit_style); break;
+                    case 1: cursor_raw(c, insert, styleString, styleStringReplace); break;
+                    default:
+                        cursor_emit(c, lit_styleend);
+                        f->aux = 0;
+                        f->index++;
+                        break;
+                }
+            } else {
+                switch (f->aux++) {
+                    case 0: cursor_emit(c, lit_script); break;
+                    case 1: cursor_raw(c, insert, scriptString, scriptStringReplace); break;
+                    default:
+                        cursor_emit(c, lit_scriptend);
+                        f->aux = 0;
+                        f->index++;
+                        break;
+                }
+            }
+            break;
+        case 2:
+            if (standalone)
+                cursor_emit(c, lit_headend);
+            f->phase = 3;
+            f->index = 0;
+            break;
+        case 3: /* Body */
+            if (f->index < document->itemCount) {
+                cursor_push(c, FRAME_NODE, document->items + f->index++);
+            } else {
+                f->phase = 4;
+            }
+            break;
+        default:
+            if (standalone && !(c->options & HTML_NOTAIL))
+                cursor_emit(c, lit_docend);
+            c->stackCount--;
+            break;
+    }
+}
+
+/* Nodes that are just a line wrapped in a tag. */
+static void step_wrapped(struct bkd_html_cursor * c, struct bkd_html_frame * f,
+        struct bkd_linenode * line, struct bkd_string open, struct bkd_string close) {
+    switch (f->phase++) {
+        case 0: cursor_emit(c, open); break;
+        case 1: cursor_push(c, FRAME_LINE, line); break;
+        case 2: cursor_emit(c, close); break;
+        default: c->stackCount--; break;
+    }
+}
+
+static void step_node(struct bkd_html_cursor * c, struct bkd_html_frame * f) {
+    struct bkd_node * node = (struct bkd_node *) f->item;
+    uint32_t style, headerSize;
     switch (node->type) {
         case BKD_PARAGRAPH:
-            bkd_puts(out, "<p>");
-            print_line(out, &node->data.paragraph.text);
-            bkd_puts(out, "</p>");
+            step_wrapped(c, f, &node->data.paragraph.text, lit_p, lit_pend);
             break;
-        case BKD_LIST:
-            switch(node->data.list.style) {
-                case BKD_LISTSTYLE_NONE: bkd_puts(out, "<div class=\"bkd-subdoc\">"); listWrap = 0; break;
-                case BKD_LISTSTYLE_NUMBERED: bkd_puts(out, "<ol type=\"1\" class=\"bkd-list-numbered\">"); break;
-                case BKD_LISTSTYLE_BULLETS: bkd_puts(out, "<ul class=\"bkd-list-bullets\">"); break;
-                case BKD_LISTSTYLE_ROMAN: bkd_puts(out, "<ol type=\"I\" class=\"bkd-list-roman\">"); break;
-                case BKD_LISTSTYLE_ALPHA: bkd_puts(out, "<ol type=\"A\" class=\"bkd-list-alpha\">"); break;
+        case BKD_COMMENTBLOCK:
+            step_wrapped(c, f, &node->data.commentblock.text, lit_blockquote, lit_blockquoteend);
+            break;
+        case BKD_TEXT:
+            step_wrapped(c, f, &node->data.text, lit_empty, lit_empty);
+            break;
+        case BKD_HEADER:
+            headerSize = node->data.header.size;
+            if (headerSize > 6)
+                headerSize = 6;
+            switch (f->phase++) {
+                case 0:
+                    memcpy(c->scratch, "<h0>", 4);
+                    c->scratch[2] += headerSize;
+                    cursor_emit(c, (struct bkd_string) {4, c->scratch});
+                    break;
+                case 1:
+                    cursor_push(c, FRAME_LINE, &node->data.header.text);
+                    break;
+                case 2:
+                    memcpy(c->scratch, "</h0>", 5);
+                    c->scratch[3] += headerSize;
+                    cursor_emit(c, (struct bkd_string) {5, c->scratch});
+                    break;
                 default:
+                    c->stackCount--;
                     break;
             }
-            if (listWrap) {
-                for (uint32_t i = 0; i < node->data.list.itemCount; i++) {
-                    bkd_puts(out, "<li>");
-                    print_node(out, node->data.list.items + i);
-                    bkd_puts(out, "</li>");
-                }
-            } else {
-                for (uint32_t i = 0; i < node->data.list.itemCount; i++)
-                    print_node(out, node->data.list.items + i);
-            }
-            switch(node->data.list.style) {
-                case BKD_LISTSTYLE_NONE: bkd_puts(out, "</div>"); break;
-                case BKD_LISTSTYLE_NUMBERED: bkd_puts(out, "</ol>"); break;
-                case BKD_LISTSTYLE_BULLETS: bkd_puts(out, "</ul>"); break;
-                case BKD_LISTSTYLE_ROMAN: bkd_puts(out, "</ol>"); break;
-                case BKD_LISTSTYLE_ALPHA: bkd_puts(out, "</ol>"); break;
+            break;
+        case BKD_LIST:
+            style = node->data.list.style;
+            if (style > BKD_LISTSTYLE_ROMANLOWER) style = BKD_LISTSTYLE_ROMANLOWER;
+            switch (f->phase) {
+                case 0:
+                    cursor_emit(c, list_tags[style].open);
+                    f->phase = 1;
+                    break;
+                case 1:
+                    if (f->index >= node->data.list.itemCount) {
+                        f->phase = 4;
+                        break;
+                    }
+                    if (list_tags[style].wrap)
+                        cursor_emit(c, lit_li);
+                    f->phase = 2;
+                    break;
+                case 2:
+                    f->phase = 3;
+                    cursor_push(c, FRAME_NODE, node->data.list.items + f->index);
+                    break;
+                case 3:
+                    if (list_tags[style].wrap)
+                        cursor_emit(c, lit_liend);
+                    f->index++;
+                    f->phase = 1;
+                    break;
+                case 4:
+                    cursor_emit(c, list_tags[style].close);
+                    f->phase = 5;
+                    break;
                 default:
+                    c->stackCount--;
                     break;
             }
             break;
         case BKD_TABLE:
-            bkd_puts(out, "<table>");
-            uint32_t cols = node->data.table.cols;
-            uint32_t count = node->data.table.itemCount;
-            uint32_t cellIndex = 0;
-            while (cellIndex < count) {
-                bkd_puts(out, "<tr>");
-                for (uint32_t i = 0; cellIndex < count && i < cols; i++, cellIndex++) {
-                    bkd_puts(out, "<td>");
-                    print_node(out, node->data.table.items + cellIndex);
-                    bkd_puts(out, "</td>");
-                }
-                bkd_puts(out, "</tr>");
+            /* index is the cell, aux the column in the current row */
+            switch (f->phase) {
+                case 0:
+                    cursor_emit(c, lit_table);
+                    f->phase = 1;
+                    break;
+                case 1:
+                    if (f->index >= node->data.table.itemCount) {
+                        f->phase = 5;
+                        break;
+                    }
+                    cursor_emit(c, lit_tr);
+                    f->aux = 0;
+                    f->phase = 2;
+                    break;
+                case 2:
+                    if (f->index < node->data.table.itemCount && f->aux < node->data.table.cols) {
+                        cursor_emit(c, lit_td);
+                        f->phase = 3;
+                    } else {
+                        cursor_emit(c, lit_trend);
+                        f->phase = 1;
+                    }
+                    break;
+                case 3:
+                    f->phase = 4;
+                    cursor_push(c, FRAME_NODE, node->data.table.items + f->index);
+                    break;
+                case 4:
+                    cursor_emit(c, lit_tdend);
+                    f->index++;
+                    f->aux++;
+                    f->phase = 2;
+                    break;
+                case 5:
+                    cursor_emit(c, lit_tableend);
+                    f->phase = 6;
+                    break;
+                default:
+                    c->stackCount--;
+                    break;
             }
-            bkd_puts(out, "</table>");
             break;
-        case BKD_HEADER:
-            headerSize = node->data.header.size;
-            if (headerSize > 6) {
-                headerSize = 6;
+        case BKD_HORIZONTALRULE:
+            cursor_emit(c, node->data.linebreak.style == BKD_DOTTED ? lit_hrdotted : lit_hrsolid);
+            c->stackCount--;
+            break;
+        case BKD_CODEBLOCK:
+            switch (f->phase) {
+                case 0:
+                    if (node->data.codeblock.language.length > 0) {
+                        cursor_emit(c, lit_codeblocklang);
+                        f->phase = 1;
+                    } else {
+                        cursor_emit(c, lit_codeblock);
+                        f->phase = 3;
+                    }
+                    break;
+                case 1:
+                    cursor_attr(c, node->data.codeblock.language, 0);
+                    f->phase = 2;
+                    break;
+                case 2:
+                    cursor_emit(c, lit_codeblocklangend);
+                    f->phase = 3;
+                    break;
+                case 3:
+                    cursor_text(c, node->data.datastring, 0);
+                    f->phase = 4;
+                    break;
+                case 4:
+                    cursor_emit(c, lit_codeblockend);
+                    f->phase = 5;
+                    break;
+                default:
+                    c->stackCount--;
+                    break;
             }
-            uint8_t headerdata[2] = {'h', '0'};
-            struct bkd_string headerString = {
-                2,
-                headerdata
-            };
-            headerdata[1] += headerSize;
-            bkd_putc(out, '<');
-            bkd_putn(out, headerString);
-            bkd_putc(out, '>');
-            print_line(out, &node->data.header.text);
-            bkd_putc(out, '<');
-            bkd_putc(out, '/');
-            bkd_putn(out, headerString);
-            bkd_putc(out, '>');
             break;
-        case BKD_HORIZONTALRULE:
-            if (node->data.linebreak.style == BKD_DOTTED) {
-                bkd_puts(out, "<hr class=\"bkd-dotted\">");
-            } else {
-                bkd_puts(out, "<hr class=\"bkd-solid\">");
+        case BKD_DATASTRING:
+            switch (f->phase++) {
+                case 0: cursor_emit(c, lit_datastring); break;
+                case 1: cursor_text(c, node->data.datastring, 0); break;
+                case 2: cursor_emit(c, lit_datastringend); break;
+                default: c->stackCount--; break;
             }
             break;
-        case BKD_CODEBLOCK:
-            if (node->data.codeblock.language.length > 0) {
-                bkd_puts(out, "<pre><code data-bkd-language=\"");
-                print_html_utf8(out, node->data.codeblock.language, 0);
-                bkd_puts(out, "\">");
+        default:
+            c->error = BKD_ERROR_UNKNOWN_NODE;
+            break;
+    }
+}
+
+static int markup_active(struct bkd_linenode * t, uint32_t i) {
+    return (t->markup & markup_tags[i].markup) &&
+        (!(markup_tags[i].flags & MARKUP_NEEDSDATA) || t->data.length > 0);
+}
+
+static void step_line(struct bkd_html_cursor * c, struct bkd_html_frame * f) {
+    struct bkd_linenode * t = (struct bkd_linenode *) f->item;
+    switch (f->phase) {
+        case LINE_OPEN:
+            while (f->aux < MARKUP_TAGCOUNT && !markup_active(t, f->aux))
+                f->aux++;
+            if (f->aux == MARKUP_TAGCOUNT) {
+                f->phase = LINE_IMAGE;
+                break;
+            }
+            cursor_emit(c, markup_open(t->markup, f->aux));
+            if (markup_tags[f->aux].flags & MARKUP_HASDATA)
+                f->phase = LINE_OPENDATA;
+            else
+                f->aux++;
+            break;
+        case LINE_OPENDATA:
+            cursor_attr(c, t->data, (markup_tags[f->aux].flags & MARKUP_DATANEWLINES) ? htmlflag_newline : 0);
+            f->phase = LINE_OPENEND;
+            break;
+        case LINE_OPENEND:
+            cursor_emit(c, markup_tags[f->aux].openEnd);
+            f->aux++;
+            f->phase = LINE_OPEN;
+            break;
+        case LINE_IMAGE:
+            if (t->markup & BKD_IMAGE) {
+                cursor_emit(c, lit_img);
+                f->phase = LINE_IMAGEDATA;
             } else {
-                bkd_puts(out, "<pre><code>");
+                f->phase = LINE_CODE;
             }
-            print_html_utf8(out, node->data.datastring, 0);
-            bkd_puts(out, "</code></pre>");
             break;
-        case BKD_COMMENTBLOCK:
-            bkd_puts(out, "<blockquote>");
-            print_line(out, &node->data.commentblock.text);
-            bkd_puts(out, "</blockquote>");
+        case LINE_IMAGEDATA:
+            cursor_attr(c, t->data, 0);
+            f->phase = LINE_IMAGEEND;
             break;
-        case BKD_DATASTRING:
-            bkd_puts(out, "<div hidden class=\"bkd-datastring\">");
-            print_html_utf8(out, node->data.datastring, 0);
-            bkd_puts(out, "</div>");
+        case LINE_IMAGEEND:
+            /* Images have no content */
+            cursor_emit(c, lit_imgend);
+            f->aux = MARKUP_TAGCOUNT;
+            f->phase = LINE_CLOSE;
             break;
-        case BKD_TEXT:
-            print_line(out, &node->data.text);
+        case LINE_CODE:
+            if (t->markup & BKD_CODEINLINE)
+                cursor_emit(c, lit_code);
+            f->phase = LINE_CONTENT;
+            break;
+        case LINE_CONTENT:
+            if (t->nodeCount == 0) {
+                cursor_text(c, t->tree.leaf, htmlflag_newline);
+                f->phase = LINE_CODEEND;
+            } else if (f->index < t->nodeCount) {
+                cursor_push(c, FRAME_LINE, t->tree.node + f->index++);
+            } else {
+                f->phase = LINE_CODEEND;
+            }
+            break;
+        case LINE_CODEEND:
+            if (t->markup & BKD_CODEINLINE)
+                cursor_emit(c, lit_codeend);
+            f->aux = MARKUP_TAGCOUNT;
+            f->phase = LINE_CLOSE;
             break;
         default:
-            return BKD_ERROR_UNKNOWN_NODE;
+            while (f->aux > 0 && !markup_active(t, f->aux - 1))
+                f->aux--;
+            if (f->aux == 0) {
+                c->stackCount--;
+                break;
+            }
+            f->aux--;
+            cursor_emit(c, markup_close(t->markup, f->aux));
+            break;
     }
-    return 0;
 }
 
-int32_t bkd_html_fragment(struct bkd_ostream * out, struct bkd_node * node) {
-    return print_node(out, node);
+int bkd_html_cursor_render(
+        struct bkd_html_cursor * cursor,
+        uint8_t * buffer,
+        uint32_t size,
+        uint32_t * written) {
+    struct bkd_html_frame * f;
+    cursor->out = buffer;
+    cursor->room = size;
+    while (!cursor->error) {
+        if (cursor->pending.length) {
+            cursor_emit(cursor, cursor->pending);
+            if (cursor->pending.length) break;
+        } else if (cursor->room == 0) {
+            break;
+        } else if (cursor->textActive) {
+            cursor_step_text(cursor);
+        } else if (cursor->rawActive) {
+            cursor_step_raw(cursor);
+        } else if (cursor->stackCount > 0) {
+            f = cursor_stack(cursor) + cursor->stackCount - 1;
+            switch (f->kind) {
+                case FRAME_DOC: step_doc(cursor, f); break;
+                case FRAME_NODE: step_node(cursor, f); break;
+                default: step_line(cursor, f); break;
+            }
+        } else {
+            cursor->done = 1;
+            break;
+        }
+    }
+    *written = size - cursor->room;
+    return cursor->error;
 }
 
-static uint8_t styleStringData[] = "</style>";
-static struct bkd_string styleString = {8, styleStringData};
+/* Render everything through a cursor into the stream. */
 
-static uint8_t styleStringReplaceData[] = "<\\/style>";
-static struct bkd_string styleStringReplace = {9, styleStringReplaceData};
+static int32_t html_stream(struct bkd_ostream * out, struct bkd_html_cursor * cursor) {
+    uint8_t buffer[4096];
+    uint32_t written;
+    int32_t error = 0;
+    while (!bkd_html_cursor_done(cursor)) {
+        error = bkd_html_cursor_render(cursor, buffer, sizeof(buffer), &written);
+        if (written)
+            bkd_putn(out, (struct bkd_string) {written, buffer});
+        if (error)
+            break;
+    }
+    bkd_html_cursor_free(cursor);
+    return error;
+}
 
-static uint8_t scriptStringData[] = "</script>";
-static struct bkd_string scriptString = {9, scriptStringData};
+int32_t bkd_html_fragment(struct bkd_ostream * out, struct bkd_node * node) {
+    return bkd_html_fragment_opt(out, node, 0);
+}
 
-static uint8_t scriptStringReplaceData[] = "<\\/script>";
-static struct bkd_string scriptStringReplace = {10, scriptStringReplaceData};
+int32_t bkd_html_fragment_opt(struct bkd_ostream * out, struct bkd_node * node, uint32_t options) {
+    struct bkd_html_cursor cursor;
+    int32_t error;
+    if ((error = bkd_html_cursor_init_fragment(&cursor, node)))
+        return error;
+    cursor.options = options & BKD_OPTION_RAWUTF8;
+    return html_stream(out, &cursor);
+}
 
 int32_t bkd_html(
         struct bkd_ostream * out,
@@ -378,51 +1002,319 @@ int32_t bkd_html(
         uint32_t options,
         uint32_t insertCount,
         struct bkd_htmlinsert * inserts) {
+    struct bkd_html_cursor cursor;
     int32_t error;
-    struct bkd_htmlinsert *insert;
-    if (options & BKD_OPTION_STANDALONE)
-        bkd_puts(out, "<!DOCTYPE html><html><head><meta charset=\"UTF-8\">");
-    for (uint32_t i = 0; i < insertCount; i++) {
-        insert = inserts + i;
-        if (insert->type & BKD_HTML_INSERTSTYLE) {
-            if (insert->type & BKD_HTML_INSERT_ISLINK) {
-                bkd_puts(out, "<link rel=\"stylesheet\" type=\"text/css\" href=\"");
-                print_html_utf8(out, insert->data.string, 0);
-                bkd_puts(out, "\">");
+    if ((error = bkd_html_cursor_init(&cursor, document, options, insertCount, inserts)))
+        return error;
+    if ((error = html_stream(out, &cursor)))
+        BKD_ERROR(error);
+    return error;
+}
+
+/* Render the parts of a document around its body. */
+static int32_t html_part(struct bkd_ostream * out, uint32_t options,
+        uint32_t insertCount, struct bkd_htmlinsert * inserts) {
+    struct bkd_list empty = {BKD_LISTSTYLE_NONE, 0, NULL, NULL};
+    struct bkd_html_cursor cursor;
+    int32_t error;
+    if ((error = bkd_html_cursor_init(&cursor, &empty, options, insertCount, inserts)))
+        return error;
+    if ((error = html_stream(out, &cursor)))
+        BKD_ERROR(error);
+    return error;
+}
+
+int32_t bkd_html_begin(
+        struct bkd_ostream * out,
+        uint32_t options,
+        uint32_t insertCount,
+        struct bkd_htmlinsert * inserts) {
+    return html_part(out, options | HTML_NOTAIL, insertCount, inserts);
+}
+
+int32_t bkd_html_end(struct bkd_ostream * out, uint32_t options) {
+    return html_part(out, options | HTML_NOHEAD, 0, NULL);
+}
+
+/*
+ * Compact documents
+ *
+ * These are walked directly and written through a small buffer, without
+ * recursion, so no document is nested too deeply to write.
+ */
+
+struct compact_writer {
+    struct bkd_ostream * out;
+    uint32_t flags;
+    uint32_t length;
+    uint8_t buffer[4096];
+};
+
+static void writer_flush(struct compact_writer * w) {
+    if (w->length)
+        bkd_putn(w->out, (struct bkd_string) {w->length, w->buffer});
+    w->length = 0;
+}
+
+static void writer_put(struct compact_writer * w, struct bkd_string string) {
+    if (w->length + string.length > sizeof(w->buffer)) {
+        writer_flush(w);
+        if (string.length > sizeof(w->buffer)) {
+            bkd_putn(w->out, string);
+            return;
+        }
+    }
+    memcpy(w->buffer + w->length, string.data, string.length);
+    w->length += string.length;
+}
+
+static void writer_text(struct compact_writer * w, struct bkd_string text, uint32_t flags) {
+    uint32_t used, written;
+    for (;;) {
+        used = html_escape_into(text, flags | w->flags, w->buffer + w->length, sizeof(w->buffer) - w->length, &written);
+        w->length += written;
+        if (used == text.length)
+            return;
+        text.data += used;
+        text.length -= used;
+        writer_flush(w);
+    }
+}
+
+/* Opens a span. Returns 1 for images, which have no content. */
+static int span_open(struct compact_writer * w, const struct bkd_compact * c,
+        const struct bkd_span * span) {
+    struct bkd_string data = bkd_compact_dataid(c, span->data);
+    for (uint32_t i = 0; i < MARKUP_TAGCOUNT; i++) {
+        if (!(span->markup & markup_tags[i].markup) ||
+                ((markup_tags[i].flags & MARKUP_NEEDSDATA) && !data.length))
+            continue;
+        writer_put(w, markup_open(span->markup, i));
+        if (markup_tags[i].flags & MARKUP_HASDATA) {
+            writer_text(w, data, (markup_tags[i].flags & MARKUP_DATANEWLINES) ? htmlflag_newline : 0);
+            writer_put(w, markup_tags[i].openEnd);
+        }
+    }
+    if (span->markup & BKD_IMAGE) {
+        writer_put(w, lit_img);
+        writer_text(w, data, 0);
+        writer_put(w, lit_imgend);
+        return 1;
+    }
+    if (span->markup & BKD_CODEINLINE)
+        writer_put(w, lit_code);
+    return 0;
+}
+
+static void span_close(struct compact_writer * w, const struct bkd_compact * c,
+        const struct bkd_span * span) {
+    uint32_t dataLength = span->data ? bkd_compact_dataid(c, span->data).length : 0;
+    if ((span->markup & (BKD_CODEINLINE | BKD_IMAGE)) == BKD_CODEINLINE)
+        writer_put(w, lit_codeend);
+    for (uint32_t i = MARKUP_TAGCOUNT; i > 0; i--) {
+        if ((span->markup & markup_tags[i - 1].markup) &&
+                (!(markup_tags[i - 1].flags & MARKUP_NEEDSDATA) || dataLength))
+            writer_put(w, markup_close(span->markup, i - 1));
+    }
+}
+
+/* Renders a line in one pass over its text and spans. */
+static void compact_line(struct compact_writer * w, const struct bkd_compact * c, uint32_t id) {
+    struct bkd_string text = bkd_compact_text(c, id);
+    const struct bkd_span * spans = c->spans + c->spanStarts[id];
+    uint32_t count = c->spanStarts[id + 1] - c->spanStarts[id];
+    uint32_t pos = 0, i = 0, open = BKD_SPAN_NONE;
+    while (i < count || open != BKD_SPAN_NONE) {
+        /* Close the spans that end before the next one opens. */
+        if (open != BKD_SPAN_NONE && (i >= count || spans[open].last < i)) {
+            writer_text(w, (struct bkd_string) {spans[open].end - pos, text.data + pos}, htmlflag_newline);
+            pos = spans[open].end;
+            span_close(w, c, spans + open);
+            open = spans[open].parent;
+            continue;
+        }
+        writer_text(w, (struct bkd_string) {spans[i].start - pos, text.data + pos}, htmlflag_newline);
+        pos = spans[i].start;
+        open = i;
+        if (span_open(w, c, spans + i)) {
+            pos = spans[i].end;
+            i = spans[i].last + 1;
+        } else {
+            i++;
+        }
+    }
+    writer_text(w, (struct bkd_string) {text.length - pos, text.data + pos}, htmlflag_newline);
+}
+
+/* Renders a node without children of its own. */
+static int compact_leaf(struct compact_writer * w, const struct bkd_compact * c, uint32_t id) {
+    uint32_t flags = c->flags[id];
+    uint8_t tag[5];
+    switch (c->kinds[id]) {
+        case BKD_PARAGRAPH:
+            writer_put(w, lit_p);
+            compact_line(w, c, id + 1);
+            writer_put(w, lit_pend);
+            break;
+        case BKD_COMMENTBLOCK:
+            writer_put(w, lit_blockquote);
+            compact_line(w, c, id + 1);
+            writer_put(w, lit_blockquoteend);
+            break;
+        case BKD_TEXT:
+            compact_line(w, c, id + 1);
+            break;
+        case BKD_HEADER:
+            if (flags > 6) flags = 6;
+            memcpy(tag, "<h0>", 4);
+            tag[2] += flags;
+            writer_put(w, (struct bkd_string) {4, tag});
+            compact_line(w, c, id + 1);
+            memcpy(tag, "</h0>", 5);
+            tag[3] += flags;
+            writer_put(w, (struct bkd_string) {5, tag});
+            break;
+        case BKD_HORIZONTALRULE:
+            writer_put(w, flags == BKD_DOTTED ? lit_hrdotted : lit_hrsolid);
+            break;
+        case BKD_CODEBLOCK:
+            if (c->dataIds[id]) {
+                writer_put(w, lit_codeblocklang);
+                writer_text(w, bkd_compact_data(c, id), 0);
+                writer_put(w, lit_codeblocklangend);
             } else {
-                bkd_puts(out, "<style>");
-                if (insert->type & BKD_HTML_INSERT_ISSTREAM) {
-                    print_escape_stream(out, insert->data.stream, styleString, styleStringReplace);
-                } else {
-                    print_escape_sequence_no_repeat(out, insert->data.string, styleString, styleStringReplace);
-                }
-                bkd_puts(out, "</style>");
+                writer_put(w, lit_codeblock);
             }
-        } else if (insert->type & BKD_HTML_INSERTSCRIPT) {
-            if (insert->type & BKD_HTML_INSERT_ISLINK) {
-                bkd_puts(out, "<script type=\"text/javascript\" src=\"");
-                print_html_utf8(out, insert->data.string, 0);
-                bkd_puts(out, "\"></script>");
+            writer_text(w, bkd_compact_text(c, id), 0);
+            writer_put(w, lit_codeblockend);
+            break;
+        case BKD_DATASTRING:
+            writer_put(w, lit_datastring);
+            writer_text(w, bkd_compact_text(c, id), 0);
+            writer_put(w, lit_datastringend);
+            break;
+        default:
+            return BKD_ERROR_UNKNOWN_NODE;
+    }
+    return 0;
+}
+
+/* A list or table being rendered, and the table column of its next child. */
+struct compact_open {
+    uint32_t id;
+    uint32_t column;
+};
+
+#define COMPACT_OPENFRAMES 32
+
+static uint32_t compact_liststyle(const struct bkd_compact * c, uint32_t id) {
+    return c->flags[id] > BKD_LISTSTYLE_ROMANLOWER ? BKD_LISTSTYLE_ROMANLOWER : c->flags[id];
+}
+
+/* Writes what goes before a child of a list or table. */
+static void compact_itemopen(struct compact_writer * w, const struct bkd_compact * c,
+        struct compact_open * parent) {
+    if (c->kinds[parent->id] == BKD_TABLE) {
+        if (parent->column == 0)
+            writer_put(w, lit_tr);
+        writer_put(w, lit_td);
+    } else if (list_tags[compact_liststyle(c, parent->id)].wrap) {
+        writer_put(w, lit_li);
+    }
+}
+
+/* Writes what goes after a child of a list or table. */
+static void compact_itemclose(struct compact_writer * w, const struct bkd_compact * c,
+        struct compact_open * parent) {
+    if (c->kinds[parent->id] == BKD_TABLE) {
+        writer_put(w, lit_tdend);
+        if (++parent->column >= c->flags[parent->id]) {
+            writer_put(w, lit_trend);
+            parent->column = 0;
+        }
+    } else if (list_tags[compact_liststyle(c, parent->id)].wrap) {
+        writer_put(w, lit_liend);
+    }
+}
+
+/* Renders the children of the document in one pass over the node ids. Lists
+ * and tables that are open are kept on a stack, which only moves to the heap
+ * for deeply nested documents. The document itself is the bottom of the stack
+ * and is never wrapped in tags. */
+static int compact_nodes(struct compact_writer * w, const struct bkd_compact * c) {
+    struct compact_open local[COMPACT_OPENFRAMES];
+    struct compact_open * stack = local, * top, * grown;
+    uint32_t count = 1, capacity = COMPACT_OPENFRAMES, id = 1;
+    int error = 0;
+    stack[0] = (struct compact_open) {0, 0};
+    while (!error && count) {
+        top = stack + count - 1;
+        if (id >= c->next[top->id]) {
+            if (--count == 0)
+                break;
+            if (c->kinds[top->id] == BKD_TABLE) {
+                if (top->column)
+                    writer_put(w, lit_trend);
+                writer_put(w, lit_tableend);
             } else {
-                bkd_puts(out, "<script type=\"text/javascript\">");
-                if (insert->type & BKD_HTML_INSERT_ISSTREAM) {
-                    print_escape_stream(out, insert->data.stream, scriptString, scriptStringReplace);
-                } else {
-                    print_escape_sequence_no_repeat(out, insert->data.string, scriptString, scriptStringReplace);
-                }
-                bkd_puts(out, "</script>");
+                writer_put(w, list_tags[compact_liststyle(c, top->id)].close);
             }
+            if (count > 1)
+                compact_itemclose(w, c, top - 1);
+            continue;
         }
-    }
-    if (options & BKD_OPTION_STANDALONE)
-        bkd_puts(out, "</head><body>");
-    for (uint32_t i = 0; i < document->itemCount; i++) {
-        if ((error = print_node(out, document->items + i))) {
-            BKD_ERROR(error);
-            return error;
+        if (count > 1)
+            compact_itemopen(w, c, top);
+        if (c->kinds[id] != BKD_LIST && c->kinds[id] != BKD_TABLE) {
+            error = compact_leaf(w, c, id);
+            if (count > 1)
+                compact_itemclose(w, c, top);
+            id = c->next[id];
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            if (stack == local) {
+                if ((grown = BKD_MALLOC(capacity * sizeof(struct compact_open))))
+                    memcpy(grown, local, sizeof(local));
+            } else {
+                grown = BKD_REALLOC(stack, capacity * sizeof(struct compact_open));
+            }
+            if (!grown) {
+                error = BKD_ERROR_OUT_OF_MEMORY;
+                break;
+            }
+            stack = grown;
         }
+        if (c->kinds[id] == BKD_TABLE)
+            writer_put(w, lit_table);
+        else
+            writer_put(w, list_tags[compact_liststyle(c, id)].open);
+        stack[count++] = (struct compact_open) {id, 0};
+        id++;
     }
-    if (options & BKD_OPTION_STANDALONE)
-        bkd_puts(out, "</body></html>\n");
-    return 0;
+    if (stack != local)
+        BKD_FREE(stack);
+    return error;
+}
+
+int32_t bkd_html_compact(
+        struct bkd_ostream * out,
+        const struct bkd_compact * document,
+        uint32_t options,
+        uint32_t insertCount,
+        struct bkd_htmlinsert * inserts) {
+    struct compact_writer w;
+    int32_t error;
+    if ((error = html_part(out, options | HTML_NOTAIL, insertCount, inserts)))
+        return error;
+    w.out = out;
+    w.flags = (options & BKD_OPTION_RAWUTF8) ? htmlflag_raw : 0;
+    w.length = 0;
+    if ((error = compact_nodes(&w, document))) {
+        BKD_ERROR(error);
+        return error;
+    }
+    writer_flush(&w);
+    return html_part(out, options | HTML_NOHEAD, 0, NULL);
 }
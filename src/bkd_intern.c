@@ -0,0 +1,98 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "bkd_intern.h"
+#include "bkd_string.h"
+
+#include <string.h>
+
+void bkd_intern_init(struct bkd_intern * table, struct bkd_arena * arena) {
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+    table->arena = arena;
+}
+
+/* Open addressing with linear probing. Capacity is a power of two and the
+ * table is kept at most half full. */
+static struct bkd_internslot * intern_find(struct bkd_internslot * slots, uint32_t capacity,
+        uint32_t hash, struct bkd_string string) {
+    uint32_t i = hash & (capacity - 1);
+    for (;;) {
+        struct bkd_internslot * slot = slots + i;
+        if (!slot->string.data)
+            return slot;
+        if (slot->hash == hash && bkd_strequal(slot->string, string))
+            return slot;
+        i = (i + 1) & (capacity - 1);
+    }
+}
+
+static int intern_grow(struct bkd_intern * table) {
+    uint32_t capacity = table->capacity ? 2 * table->capacity : 64;
+    struct bkd_internslot * slots = BKD_CALLOC(capacity, sizeof(struct bkd_internslot));
+    if (!slots) {
+        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        return 0;
+    }
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        struct bkd_internslot * old = table->slots + i;
+        if (old->string.data)
+            *intern_find(slots, capacity, old->hash, old->string) = *old;
+    }
+    BKD_FREE(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+    return 1;
+}
+
+struct bkd_string bkd_intern(struct bkd_intern * table, struct bkd_string string) {
+    struct bkd_internslot * slot;
+    uint32_t hash;
+    uint8_t * copy;
+    if (string.length == 0) return BKD_NULLSTR;
+    if (2 * (table->count + 1) > table->capacity && !intern_grow(table))
+        return BKD_NULLSTR;
+    hash = bkd_strhash(string);
+    slot = intern_find(table->slots, table->capacity, hash, string);
+    if (slot->string.data)
+        return slot->string;
+    copy = table->arena ? bkd_arena_alloc(table->arena, string.length) : BKD_MALLOC(string.length);
+    if (!copy) {
+        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        return BKD_NULLSTR;
+    }
+    memcpy(copy, string.data, string.length);
+    slot->hash = hash;
+    slot->string.data = copy;
+    slot->string.length = string.length;
+    table->count++;
+    return slot->string;
+}
+
+void bkd_intern_free(struct bkd_intern * table) {
+    if (!table->arena) {
+        for (uint32_t i = 0; i < table->capacity; i++)
+            bkd_strfree(table->slots[i].string);
+    }
+    BKD_FREE(table->slots);
+    bkd_intern_init(table, table->arena);
+}
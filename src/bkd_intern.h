@@ -0,0 +1,48 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef BKD_INTERN_
+#define BKD_INTERN_
+
+#include "bkd.h"
+#include "bkd_arena.h"
+
+/* Intern table. Equal strings put into the table come back as one shared
+ * copy, which belongs to the table. Copies come out of the arena if there is
+ * one, and are freed with the table otherwise. */
+
+struct bkd_internslot {
+    uint32_t hash;
+    struct bkd_string string;
+};
+
+struct bkd_intern {
+    struct bkd_internslot * slots;
+    uint32_t capacity;
+    uint32_t count;
+    struct bkd_arena * arena;
+};
+
+void bkd_intern_init(struct bkd_intern * table, struct bkd_arena * arena);
+struct bkd_string bkd_intern(struct bkd_intern * table, struct bkd_string string);
+void bkd_intern_free(struct bkd_intern * table);
+
+#endif /* end of include guard: BKD_INTERN_ */
@@ -23,6 +23,9 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "bkd_utf8.h"
 #include "bkd_string.h"
 #include "bkd_stretchy.h"
+#include "bkd_arena.h"
+#include "bkd_intern.h"
+#include "bkd_scan.h"
 
 #include <string.h>
 
@@ -69,6 +72,9 @@ static inline uint32_t read_escape(struct bkd_string string, uint32_t * escapeLe
                 accumulator = 16 * accumulator + readHex(codepoint);
             }
             *escapeLength = length;
+            /* Keep the text valid UTF-8. */
+            if (accumulator > BKD_UTF8_MAXCODEPOINT || (accumulator >= 0xD800 && accumulator < 0xE000))
+                return BKD_UTF8_REPLACEMENT;
             return accumulator;
         default:
             *escapeLength = bkd_utf8_sizep(codepoint);
@@ -76,53 +82,107 @@ static inline uint32_t read_escape(struct bkd_string string, uint32_t * escapeLe
     }
 }
 
-struct bkd_string bkd_strescape_new(struct bkd_string string) {
+static void cleanup_node(struct bkd_node * node);
+static void cleanup_nodes(struct bkd_node * items, uint32_t count);
+
+/* Reports an error, and records it in error if it is the first. Error may be
+ * NULL. */
+static void parse_fail(int32_t * error, int32_t code) {
+    BKD_ERROR(code);
+    if (error && !*error)
+        *error = code;
+}
+
+/* Allocate AST memory from the arena, or with BKD_MALLOC if there is none. */
+static inline void * parse_alloc(struct bkd_arena * arena, size_t size) {
+    return arena ? bkd_arena_alloc(arena, size) : BKD_MALLOC(size);
+}
+
+static struct bkd_string parse_strcopy(struct bkd_arena * arena, struct bkd_string string, int32_t * error) {
     struct bkd_string ret;
+    if (string.length == 0) return BKD_NULLSTR;
+    ret.data = parse_alloc(arena, string.length);
+    if (!ret.data) {
+        parse_fail(error, BKD_ERROR_OUT_OF_MEMORY);
+        return BKD_NULLSTR;
+    }
+    ret.length = string.length;
+    memcpy(ret.data, string.data, string.length);
+    return ret;
+}
+
+/* Decodes escapes into out, and returns the decoded length. The result is
+ * never longer than the input. Text is valid UTF-8 by now, so runs between
+ * escapes are copied as they are. */
+static uint32_t strescape_into(uint8_t * out, struct bkd_string string) {
     uint32_t inNext = 0;
     uint32_t retNext = 0;
     uint32_t escapeLength = 0;
-    uint32_t codepoint;
+    uint32_t run;
+    uint8_t * slash;
+    while (inNext < string.length) {
+        slash = memchr(string.data + inNext, '\\', string.length - inNext);
+        run = slash ? (uint32_t) (slash - string.data) - inNext : string.length - inNext;
+        memcpy(out + retNext, string.data + inNext, run);
+        retNext += run;
+        inNext += run + 1;
+        if (inNext >= string.length) /* Terminating escapes are ignored. */
+            break;
+        retNext += bkd_utf8_write(out + retNext, read_escape(bkd_strsub(string, inNext, -1), &escapeLength));
+        inNext += escapeLength;
+    }
+    return retNext;
+}
+
+static struct bkd_string parse_strescape(struct bkd_arena * arena, struct bkd_string string, int32_t * error) {
+    struct bkd_string ret;
+    uint32_t retNext;
+    uint8_t * shrunk;
     if (string.length == 0) return BKD_NULLSTR;
-    ret.data = BKD_MALLOC(string.length);
+    ret.data = parse_alloc(arena, string.length);
     if (!ret.data) {
-        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        parse_fail(error, BKD_ERROR_OUT_OF_MEMORY);
         return BKD_NULLSTR;
     }
-    while (inNext < string.length) {
-        inNext += bkd_utf8_readlen(string.data + inNext, &codepoint, string.length - inNext);
-        if (codepoint == '\\') {
-            if (inNext >= string.length) /* Terminating escapes are ignored. */
-                break;
-            codepoint = read_escape(bkd_strsub(string, inNext, -1), &escapeLength);
-            inNext += escapeLength;
-        }
-        retNext += bkd_utf8_write(ret.data + retNext, codepoint);
-    }
-    ret.data = BKD_REALLOC(ret.data, retNext);
+    retNext = strescape_into(ret.data, string);
+    if (arena)
+        bkd_arena_shrink(arena, ret.data, string.length, retNext);
+    else if (retNext < string.length && retNext && (shrunk = BKD_REALLOC(ret.data, retNext)))
+        ret.data = shrunk;
     ret.length = retNext;
     return ret;
 }
 
+struct bkd_string bkd_strescape_new(struct bkd_string string) {
+    return parse_strescape(NULL, string, NULL);
+}
+
+/* Finds the first of the given delimiters that is not escaped. All delimiters
+ * are among the bytes bkd_scan_delim looks for, and ASCII bytes are never
+ * part of a longer UTF-8 character, so there is no need to decode. */
 static uint32_t find_one(struct bkd_string string, const uint32_t * codepoints, uint32_t count, uint32_t * index) {
     uint32_t pos = 0;
-    uint32_t testpoint = 0;
-    uint32_t charsize;
+    uint32_t escapeLength = 0;
     uint32_t i;
+    uint8_t c;
     while (pos < string.length) {
-        charsize = bkd_utf8_readlen(string.data + pos, &testpoint, string.length - pos);
-        if (testpoint == '\\') {
-            pos += charsize;
-            if (pos < string.length)
-                read_escape(bkd_strsub(string, pos, -1), &charsize);
-        } else {
-            for (i = 0; i < count; i++) {
-                if (testpoint == codepoints[i]) {
-                    *index = pos;
-                    return testpoint;
-                }
+        pos += bkd_scan_delim(string.data + pos, string.length - pos);
+        if (pos == string.length)
+            break;
+        c = string.data[pos++];
+        if (c == '\\') {
+            if (pos < string.length) {
+                read_escape(bkd_strsub(string, pos, -1), &escapeLength);
+                pos += escapeLength;
+            }
+            continue;
+        }
+        for (i = 0; i < count; i++) {
+            if (c == codepoints[i]) {
+                *index = pos - 1;
+                return c;
             }
         }
-        pos += charsize;
     }
     return 0;
 }
@@ -131,23 +191,96 @@ static const uint32_t brackets[] = { '[', ']' };
 static const uint32_t dataclose[] = { ')' };
 static const uint32_t opener[] = { '[' };
 
-/* Convenience function for adding nodes. */
-static inline struct bkd_linenode * add_node(struct bkd_linenode ** nodes, uint32_t * capacity, uint32_t * count) {
-    if (*count == *capacity) {
-        *capacity = 2 * (*count) + 1;
-        *nodes = BKD_REALLOC(*nodes, *capacity * sizeof(struct bkd_linenode));
-        if (!*nodes) {
-            BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
-            return NULL;
-        }
+/* Where the text being parsed came from. Each segment is a run of the text,
+ * starting at offset, that is an unchanged copy of the input at source.
+ * Leaves are made in order, so next only moves forward. */
+struct parse_segment {
+    uint32_t offset;
+    uint32_t length;
+    uint8_t * source;
+};
+
+struct parse_source {
+    struct parse_segment * segments;
+    uint32_t count;
+    uint32_t next;
+    uint8_t * base;
+};
+
+/* Scratch space for parsing lines, kept from one line to the next. The
+ * children of every open bracket sit on one node stack, and levels holds the
+ * index where each open bracket's children start. The node of an open
+ * bracket is the one just below its children. */
+struct parse_linestack {
+    struct bkd_linenode * nodes;
+    uint32_t * levels;
+};
+
+/* How text in a line gets allocated, and where the first error goes. Any of
+ * these may be NULL, except for the stack when parsing lines. */
+struct parse_linectx {
+    struct bkd_arena * arena;
+    struct parse_source * source;
+    struct bkd_intern * intern;
+    struct parse_linestack * stack;
+    int32_t * error;
+};
+
+/* Data strings longer than this are not interned. */
+#define PARSE_INTERNMAX 256
+
+/* Finds text without escapes that lies within one segment in the input. */
+static int parse_borrow(struct parse_source * source, struct bkd_string string, struct bkd_string * out) {
+    uint32_t offset;
+    struct parse_segment * seg;
+    if (!source || !string.length || memchr(string.data, '\\', string.length))
+        return 0;
+    offset = string.data - source->base;
+    while (source->next < source->count &&
+            source->segments[source->next].offset + source->segments[source->next].length <= offset)
+        source->next++;
+    seg = source->segments + source->next;
+    if (source->next < source->count && seg->offset <= offset &&
+            offset + string.length <= seg->offset + seg->length) {
+        *out = (struct bkd_string) {string.length, seg->source + (offset - seg->offset)};
+        return 1;
+    }
+    return 0;
+}
+
+/* Makes a leaf string, borrowed from the input if possible. */
+static struct bkd_string parse_leaf(struct parse_linectx * ctx, struct bkd_string string, int * borrowed) {
+    struct bkd_string ret;
+    if ((*borrowed = parse_borrow(ctx->source, string, &ret)))
+        return ret;
+    return parse_strescape(ctx->arena, string, ctx->error);
+}
+
+/* Makes a data string. Link targets and classes repeat a lot, so
+ * those that cannot be borrowed are shared through the intern table. */
+static struct bkd_string parse_data(struct parse_linectx * ctx, struct bkd_string string, int * shared) {
+    uint8_t decoded[PARSE_INTERNMAX];
+    struct bkd_string ret;
+    if ((*shared = parse_borrow(ctx->source, string, &ret)))
+        return ret;
+    if (ctx->intern && string.length > 0 && string.length <= PARSE_INTERNMAX) {
+        ret.data = decoded;
+        ret.length = strescape_into(decoded, string);
+        ret = bkd_intern(ctx->intern, ret);
+        *shared = ret.length > 0;
+        return ret;
     }
-	struct bkd_linenode * child = *nodes + *count;
-    *count = *count + 1;
+    return parse_strescape(ctx->arena, string, ctx->error);
+}
+
+/* Pushes an empty node onto the node stack. */
+static inline struct bkd_linenode * add_node(struct parse_linestack * stack) {
+    struct bkd_linenode * child = bkd_sbadd(stack->nodes, 1);
     child->markup = BKD_NONE;
     child->nodeCount = 0;
     child->data = BKD_NULLSTR;
     child->tree.leaf = BKD_NULLSTR;
-	return child;
+    return child;
 }
 
 static struct bkd_string parse_flags(struct bkd_string string, uint32_t * flags) {
@@ -179,80 +312,173 @@ static struct bkd_string parse_flags(struct bkd_string string, uint32_t * flags)
     }
 }
 
-/* Puts a string of utf8 text into a linenode struct. */
-static struct bkd_string bkd_parse_line_impl(struct bkd_linenode * l, struct bkd_string string, int root) {
-    struct bkd_string current = string;
-    uint32_t codepoint;
-    struct bkd_linenode * child;
-    uint32_t capacity = 3;
-    struct bkd_linenode * nodes = BKD_MALLOC(sizeof(struct bkd_linenode) * capacity);
-    uint32_t count = 0, index = 0;
-
-    if (!nodes) {
-        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
-        return BKD_NULLSTR;
+/* Finds the closing bracket that ends a node at the maximum depth. Opening
+ * brackets there are literal text, and so are the closing brackets that
+ * match them. */
+static uint32_t find_close(struct bkd_string string, uint32_t * index) {
+    uint32_t pos = 0, literal = 0, at = 0, c;
+    for (;;) {
+        c = find_one((struct bkd_string) {string.length - pos, string.data + pos}, brackets, 2, &at);
+        if (!c)
+            return 0;
+        pos += at + 1;
+        if (c == '[') {
+            literal++;
+        } else if (literal) {
+            literal--;
+        } else {
+            *index = pos - 1;
+            return c;
+        }
     }
+}
 
-    while (current.length) {
+/* Frees line nodes that could not be attached to their parent. Arena memory
+ * goes with the document. */
+static void parse_dropnodes(struct parse_linectx * ctx, const struct bkd_linenode * nodes, uint32_t count) {
+    struct bkd_node n;
+    if (ctx->arena)
+        return;
+    n.type = BKD_TEXT;
+    for (uint32_t i = 0; i < count; i++) {
+        n.data.text = nodes[i];
+        cleanup_node(&n);
+    }
+}
+
+/* Gives a node the children on top of the node stack, from start on, and
+ * pops them. */
+static void parse_close(struct parse_linectx * ctx, struct bkd_linenode * l, uint32_t start) {
+    struct parse_linestack * stack = ctx->stack;
+    uint32_t count = bkd_sbcount(stack->nodes) - start;
+    struct bkd_linenode * nodes;
+    if (count == 0) {
+        l->nodeCount = 0;
+        l->tree.leaf = BKD_NULLSTR;
+        return;
+    }
+    nodes = stack->nodes + start;
+    if (count == 1 && (nodes[0].markup & BKD_MARKUP_MASK) == BKD_NONE && nodes[0].data.length == 0) {
+        l->nodeCount = nodes[0].nodeCount;
+        l->tree = nodes[0].tree;
+        l->markup |= nodes[0].markup & BKD_BORROWEDLEAF;
+    } else {
+        l->nodeCount = count;
+        l->tree.node = parse_alloc(ctx->arena, sizeof(struct bkd_linenode) * count);
+        if (!l->tree.node) {
+            parse_fail(ctx->error, BKD_ERROR_OUT_OF_MEMORY);
+            parse_dropnodes(ctx, nodes, count);
+            l->nodeCount = 0;
+            l->tree.leaf = BKD_NULLSTR;
+        } else {
+            memcpy(l->tree.node, nodes, sizeof(struct bkd_linenode) * count);
+        }
+    }
+    bkd__sbn(stack->nodes) = start;
+}
+
+/* A bracket with no content shows its data as text. */
+static void parse_emptynode(struct parse_linectx * ctx, struct bkd_linenode * child) {
+    if (child->nodeCount != 0 || child->tree.leaf.length != 0)
+        return;
+    if (!ctx->arena && !(child->markup & BKD_BORROWEDLEAF))
+        bkd_strfree(child->tree.leaf);
+    if (child->markup & BKD_BORROWEDDATA) {
+        child->tree.leaf = child->data;
+        child->markup |= BKD_BORROWEDLEAF;
+    } else {
+        child->tree.leaf = parse_strcopy(ctx->arena, child->data, ctx->error);
+        child->markup &= ~BKD_BORROWEDLEAF;
+    }
+}
+
+/* Puts a string of utf8 text into a linenode struct. Brackets are parsed
+ * with the explicit stack in ctx rather than by recursion, and only up to
+ * BKD_LINE_MAXDEPTH deep. */
+static void bkd_parse_line_impl(struct parse_linectx * ctx,
+        struct bkd_linenode * l, struct bkd_string current) {
+    struct parse_linestack * stack = ctx->stack;
+    uint32_t levelBase = bkd_sbcount(stack->levels);
+    uint32_t codepoint, index, depth, start;
+    int borrowed;
+    struct bkd_linenode * child, * node;
+
+    bkd_sbpush(stack->levels, bkd_sbcount(stack->nodes));
+    for (;;) {
+        depth = bkd_sbcount(stack->levels) - levelBase - 1;
+        start = bkd_sblast(stack->levels);
         index = 0;
-        if (root)
+        if (!current.length)
+            codepoint = 0;
+        else if (depth == 0)
             codepoint = find_one(current, opener, 1, &index);
-        else
+        else if (depth < BKD_LINE_MAXDEPTH)
             codepoint = find_one(current, brackets, 2, &index);
+        else
+            codepoint = find_close(current, &index);
         if (codepoint) {
             if (index > 0) {
-                child = add_node(&nodes, &capacity, &count);
-                child->tree.leaf = bkd_strescape_new(bkd_strsub(current, 0, index - 1));
+                child = add_node(stack);
+                child->tree.leaf = parse_leaf(ctx, bkd_strsub(current, 0, index - 1), &borrowed);
+                if (borrowed) child->markup |= BKD_BORROWEDLEAF;
             }
             current = bkd_strsub(current, index + 1, -1);
+        } else if (current.length) {
+            child = add_node(stack);
+            child->tree.leaf = parse_leaf(ctx, current, &borrowed);
+            if (borrowed) child->markup |= BKD_BORROWEDLEAF;
+            current = BKD_NULLSTR;
         }
         if (codepoint == '[') {
-            child = add_node(&nodes, &capacity, &count);
+            child = add_node(stack);
             current = parse_flags(current, &child->markup);
-            current = bkd_parse_line_impl(child, current, 0);
-            if (child->nodeCount == 0 && child->tree.leaf.length == 0) {
-                bkd_strfree(child->tree.leaf);
-                child->tree.leaf = bkd_str_new(child->data);
-            }
-        } else if (codepoint == ']') {
-            if (current.length && current.data[0] == '(') {
-                if (find_one(current, dataclose, 1, &index)) {
-                    l->data = bkd_strescape_new(bkd_strsub(current, 1, index - 1));
-                    current = bkd_strsub(current, index + 1, -1);
-                } else {
-                    l->data = bkd_strescape_new(bkd_strsub(current, 1, -1));
-                    current = BKD_NULLSTR;
-                }
+            bkd_sbpush(stack->levels, bkd_sbcount(stack->nodes));
+            continue;
+        }
+        /* The node ends here, at a closing bracket or the end of the line */
+        node = depth ? stack->nodes + start - 1 : l;
+        if (codepoint == ']' && current.length && current.data[0] == '(') {
+            if (find_one(current, dataclose, 1, &index)) {
+                node->data = parse_data(ctx, bkd_strsub(current, 1, index - 1), &borrowed);
+                current = bkd_strsub(current, index + 1, -1);
+            } else {
+                node->data = parse_data(ctx, bkd_strsub(current, 1, -1), &borrowed);
+                current = BKD_NULLSTR;
             }
-            break;
-        } else {
-            child = add_node(&nodes, &capacity, &count);
-            child->tree.leaf = bkd_strescape_new(current);
-            current = BKD_NULLSTR;
+            if (borrowed) node->markup |= BKD_BORROWEDDATA;
         }
+        parse_close(ctx, node, start);
+        bkd_sbpop(stack->levels);
+        if (!depth)
+            return;
+        parse_emptynode(ctx, node);
     }
-    if (count == 0) {
-        l->nodeCount = 0;
-        l->tree.leaf = BKD_NULLSTR;
-        BKD_FREE(nodes);
-    } else if (count == 1 && nodes[0].markup == BKD_NONE && nodes[0].data.length == 0) {
-        l->nodeCount = nodes[0].nodeCount;
-        l->tree = nodes[0].tree;
-        BKD_FREE(nodes);
-    } else {
-        l->nodeCount = count;
-        l->tree.node = BKD_REALLOC(nodes, sizeof(struct bkd_linenode) * count);
-    }
-    return current;
 }
 
-/* Puts a string of utf8 text into a linenode struct. */
-struct bkd_linenode * bkd_parse_line(struct bkd_linenode * l, struct bkd_string string) {
+static struct bkd_linenode * parse_line(struct parse_linectx * ctx,
+        struct bkd_linenode * l, struct bkd_string string) {
     l->markup = BKD_NONE;
     l->data = BKD_NULLSTR;
     l->nodeCount = 0;
     l->tree.leaf = BKD_NULLSTR;
-    bkd_parse_line_impl(l, string, 1);
+    bkd_parse_line_impl(ctx, l, string);
+    return l;
+}
+
+/* Puts a string of utf8 text into a linenode struct. */
+struct bkd_linenode * bkd_parse_line(struct bkd_linenode * l, struct bkd_string string) {
+    struct parse_linestack stack = {NULL, NULL};
+    struct parse_linectx ctx = {NULL, NULL, NULL, &stack, NULL};
+    struct bkd_buffer repair = {0, BKD_NULLSTR};
+    uint32_t bad;
+    if (bkd_utf8_check(string.data, string.length, &bad) == BKD_UTF8_INVALID) {
+        repair = bkd_bufrepair(repair, string);
+        string = repair.string;
+    }
+    parse_line(&ctx, l, string);
+    bkd_sbfree(stack.nodes);
+    bkd_sbfree(stack.levels);
+    bkd_buffree(repair);
     return l;
 }
 
@@ -270,47 +496,225 @@ enum ps {
 };
 
 /* A chunk of parse state that goes onto a stack. This helps
- * represent the tree structure of the document without explicit recursion. */
+ * represent the tree structure of the document without explicit recursion.
+ * The children of a frame are at the top of the state's child stack, from
+ * childStart on. In event mode, a collapsible subdoc keeps its first child
+ * in held instead. */
 struct parse_frame {
     enum ps ps;
     uint32_t indent;
     struct bkd_node node;
-    struct bkd_node * children;
-    struct bkd_buffer buffer;
-    struct bkd_string * annotations;
+    uint32_t childStart;
+    struct bkd_node held;
+    uint8_t holding;
     uint32_t userflags;
     uint32_t useruint;
+    uint8_t opened;
 };
 
-/* The parse state */
+/* The parse state. With a handler, completed nodes are reported as events
+ * and freed instead of being attached to their parent frame. With each,
+ * the same happens to whole top level nodes. Only the topmost frame ever
+ * collects text, so all frames share one text buffer, and the children of
+ * all frames share one stack. */
 struct bkd_parsestate {
-    struct bkd_istream * in;
     struct parse_frame * stack;
+    struct bkd_node * children;
+    struct bkd_buffer text;
+    struct bkd_arena * arena;
+    struct bkd_arena arenaStorage;
+    struct bkd_intern * intern;
+    struct bkd_intern internStorage;
+    struct parse_segment * segments;
+    struct bkd_buffer repair;
+    struct parse_linestack lines;
+    uint8_t borrow;
+    uint8_t lineStable;
+    const struct bkd_handler * handler;
+    void (*each)(void * user, struct bkd_node * node);
+    void * eachUser;
+    /* The first error, or 0 */
+    int32_t error;
 };
 
 /* Add a new parse frame to the parsing stack. Sets the frame to sensible defaults. */
 static void parse_pushstate(struct bkd_parsestate * state, uint32_t indent, enum ps ps) {
     struct parse_frame top;
-    top.buffer = bkd_bufnew(180);
-    top.children = NULL;
+    top.childStart = bkd_sbcount(state->children);
+    top.holding = 0;
     top.indent = indent;
     top.ps = ps;
     top.node.type = BKD_LIST;
     top.node.data.list.itemCount = 0;
     top.node.data.list.items = NULL;
+    top.node.data.list.owner = NULL;
     top.node.data.list.style = BKD_LISTSTYLE_NONE;
     top.useruint = 0;
     top.userflags = 0;
+    top.opened = 0;
     bkd_sbpush(state->stack, top);
 }
 
-/* Convert a stretchy buffer into a nomrally allocated chunk of memory. */
-static struct bkd_node * flatten_children(struct bkd_node * stretchyBuffer) {
-    int * raw = bkd__sbraw(stretchyBuffer);
-    int count = bkd_sbcount(stretchyBuffer);
-    if (count == 0) return NULL;
-    memmove(raw, stretchyBuffer, sizeof(struct bkd_node) * count);
-    return BKD_REALLOC(raw, count * sizeof(struct bkd_node));
+/* Appends a piece of the current line to the frame's text, and remembers
+ * where it came from if the line can be borrowed from. */
+static void parse_frametext(struct bkd_parsestate * state, struct bkd_string piece) {
+    if (state->lineStable && piece.length) {
+        struct parse_segment seg = {state->text.string.length, piece.length, piece.data};
+        bkd_sbpush(state->segments, seg);
+    }
+    state->text = bkd_bufpush(state->text, piece);
+}
+
+/* Parses the text collected by the topmost frame, and empties the text
+ * buffer for the next frame. */
+static void parse_frameline(struct bkd_parsestate * state, struct bkd_linenode * l) {
+    struct parse_source source;
+    source.segments = state->segments;
+    source.count = bkd_sbcount(state->segments);
+    source.next = 0;
+    source.base = state->text.string.data;
+    struct parse_linectx ctx = {state->arena, source.count ? &source : NULL, state->intern, &state->lines, &state->error};
+    parse_line(&ctx, l, state->text.string);
+    if (state->segments)
+        bkd__sbn(state->segments) = 0;
+    state->text.string.length = 0;
+}
+
+/* Parses text that is a piece of the current line. */
+static void parse_viewline(struct bkd_parsestate * state, struct bkd_linenode * l, struct bkd_string view) {
+    struct parse_segment seg = {0, view.length, view.data};
+    struct parse_source source = {&seg, 1, 0, view.data};
+    struct parse_linectx ctx = {state->arena, state->lineStable ? &source : NULL, state->intern, &state->lines, &state->error};
+    parse_line(&ctx, l, view);
+}
+
+/* Moves the children of the topmost frame off the child stack into an
+ * array of their own. */
+static struct bkd_node * parse_children(struct bkd_parsestate * state, struct parse_frame * frame, uint32_t * count) {
+    struct bkd_node * items = NULL;
+    *count = bkd_sbcount(state->children) - frame->childStart;
+    if (*count == 0) return NULL;
+    items = parse_alloc(state->arena, *count * sizeof(struct bkd_node));
+    if (!items) {
+        parse_fail(&state->error, BKD_ERROR_OUT_OF_MEMORY);
+        if (!state->arena)
+            cleanup_nodes(state->children + frame->childStart, *count);
+        *count = 0;
+    } else {
+        memcpy(items, state->children + frame->childStart, *count * sizeof(struct bkd_node));
+    }
+    bkd__sbn(state->children) = frame->childStart;
+    return items;
+}
+
+/* Hands the text buffer over as the contents of a code block. */
+static struct bkd_string parse_taketext(struct bkd_parsestate * state) {
+    struct bkd_string text = state->text.string;
+    uint8_t * shrunk;
+    if (state->arena) {
+        text = parse_strcopy(state->arena, text, &state->error);
+        state->text.string.length = 0;
+        return text;
+    }
+    if (text.length && text.length < state->text.capacity && (shrunk = BKD_REALLOC(text.data, text.length)))
+        text.data = shrunk;
+    state->text.capacity = 0;
+    state->text.string = BKD_NULLSTR;
+    return text;
+}
+
+/* Report a complete node and everything in it as events. */
+static void event_node(struct bkd_parsestate * state, const struct bkd_node * node) {
+    const struct bkd_handler * h = state->handler;
+    struct bkd_walk walk;
+    struct bkd_walkframe * f;
+    const struct bkd_linenode * l;
+    uint32_t markup;
+    int event, marked;
+    bkd_walk_init(&walk, node, 1);
+    while ((event = bkd_walk_next(&walk))) {
+        f = bkd_walk_top(&walk);
+        if (!f->line) {
+            if ((event & BKD_WALK_ENTER) && h->open)
+                h->open(h->user, f->node);
+            if ((event & BKD_WALK_LEAVE) && h->close)
+                h->close(h->user, f->node);
+            continue;
+        }
+        l = f->line;
+        markup = l->markup & BKD_MARKUP_MASK;
+        marked = markup != BKD_NONE || l->data.length > 0;
+        if ((event & BKD_WALK_ENTER) && marked && h->markupOpen)
+            h->markupOpen(h->user, markup, l->data);
+        if ((event & BKD_WALK_ENTER) && l->nodeCount == 0 && l->tree.leaf.length > 0 && h->text)
+            h->text(h->user, l->tree.leaf);
+        if ((event & BKD_WALK_LEAVE) && marked && h->markupClose)
+            h->markupClose(h->user, markup, l->data);
+    }
+    if (walk.error && !state->error)
+        state->error = walk.error;
+    bkd_walk_free(&walk);
+}
+
+/* Make sure the frame at index and all frames below it have reported their
+ * open events. Opened frames always form the bottom of the stack, and the
+ * root frame is the document itself, so it is never reported. A collapsible
+ * subdoc only opens once it is known to have a second child, so its held
+ * first child goes out right after it. */
+static void event_open(struct bkd_parsestate * state, uint32_t index) {
+    const struct bkd_handler * h = state->handler;
+    for (uint32_t i = 1; i <= index; i++) {
+        struct parse_frame * frame = state->stack + i;
+        if (frame->opened) continue;
+        frame->opened = 1;
+        if (h->open)
+            h->open(h->user, &frame->node);
+        if (frame->holding) {
+            frame->holding = 0;
+            event_node(state, &frame->held);
+            cleanup_node(&frame->held);
+        }
+    }
+}
+
+/* Hand a completed node to the frame at index. A collapsible subdoc holds on
+ * to its first child until it knows whether it collapses. */
+static void event_child(struct bkd_parsestate * state, uint32_t index, struct bkd_node n) {
+    struct parse_frame * parent = state->stack + index;
+    if (parent->ps == PS_COLLAPSIBLE_SUBDOC && !parent->opened && !parent->holding) {
+        parent->held = n;
+        parent->holding = 1;
+        return;
+    }
+    event_open(state, index);
+    event_node(state, &n);
+    cleanup_node(&n);
+}
+
+/* Event mode counterpart of attaching the topmost frame to its parent. */
+static void event_popstate(struct bkd_parsestate * state, struct parse_frame * frame, struct bkd_node n) {
+    uint32_t top = bkd_sbcount(state->stack) - 1;
+    const struct bkd_handler * h = state->handler;
+    switch (frame->ps) {
+        case PS_COLLAPSIBLE_SUBDOC:
+            if (frame->holding) {
+                n = frame->held;
+                if (n.type == BKD_PARAGRAPH)
+                    n.type = BKD_TEXT;
+                event_child(state, top - 1, n);
+                return;
+            }
+            /* fallthrough */
+        case PS_LIST:
+        case PS_SUBDOC:
+            event_open(state, top);
+            if (h->close)
+                h->close(h->user, &n);
+            return;
+        default:
+            event_child(state, top - 1, n);
+            return;
+    }
 }
 
 /* Pops the topmost parse frame off of the stack, and finalizes any data associated
@@ -322,62 +726,63 @@ static int parse_popstate(struct bkd_parsestate * state) {
     switch (frame->ps) {
         case PS_LISTITEM:
             n.type = BKD_TEXT;
-            bkd_parse_line(&n.data.text, frame->buffer.string);
-            bkd_buffree(frame->buffer);
+            parse_frameline(state, &n.data.text);
             break;
         case PS_BLOCKCOMMENT:
             n.type = BKD_COMMENTBLOCK;
-            bkd_parse_line(&n.data.commentblock.text, frame->buffer.string);
-            bkd_buffree(frame->buffer);
+            parse_frameline(state, &n.data.commentblock.text);
             break;
         case PS_CODEBLOCK:
             n.type = BKD_CODEBLOCK;
-            n.data.codeblock.text = bkd_str_new(frame->buffer.string);
+            n.data.codeblock.text = parse_taketext(state);
+            /* The language is not part of the output yet, so it is never
+             * read from the opening fence. */
             n.data.codeblock.language = BKD_NULLSTR;
-            bkd_buffree(frame->buffer);
             break;
         case PS_RULE:
             n.type = BKD_HORIZONTALRULE;
-            bkd_buffree(frame->buffer);
             break;
         case PS_LIST:
         case PS_SUBDOC:
             n.type = BKD_LIST;
-            n.data.list.itemCount = bkd_sbcount(frame->children);
-            n.data.list.items = flatten_children(frame->children);
-            bkd_buffree(frame->buffer);
+            n.data.list.items = parse_children(state, frame, &n.data.list.itemCount);
             break;
         case PS_COLLAPSIBLE_SUBDOC:
-            if (bkd_sbcount(frame->children) == 1) { /* If we only have one child, use that child instead */
-                n = frame->children[0];
-                bkd_sbfree(frame->children);
+            if (state->handler) { /* Decided in event_popstate */
+                n.type = BKD_LIST;
+                break;
+            }
+            if (bkd_sbcount(state->children) - frame->childStart == 1) { /* If we only have one child, use that child instead */
+                n = state->children[frame->childStart];
+                bkd_sbpop(state->children);
                 if (n.type == BKD_PARAGRAPH)
                     n.type = BKD_TEXT;
             } else {
                 n.type = BKD_LIST;
-                n.data.list.itemCount = bkd_sbcount(frame->children);
-                n.data.list.items = flatten_children(frame->children);
+                n.data.list.items = parse_children(state, frame, &n.data.list.itemCount);
             }
-            bkd_buffree(frame->buffer);
             break;
         case PS_PARAGRAPH:
             n.type = BKD_PARAGRAPH;
-            bkd_parse_line(&n.data.paragraph.text, frame->buffer.string);
-            bkd_buffree(frame->buffer);
+            parse_frameline(state, &n.data.paragraph.text);
             break;
         case PS_HEADER:
-            bkd_buffree(frame->buffer);
             break;
         case PS_INLINE_GRID:
             n.type = BKD_TABLE;
-            n.data.table.itemCount = bkd_sbcount(frame->children);
-            n.data.table.items = flatten_children(frame->children);
-            bkd_buffree(frame->buffer);
+            n.data.table.items = parse_children(state, frame, &n.data.table.itemCount);
             break;
     }
     if (bkd_sbcount(state->stack) > 1) {
         struct parse_frame * newtop = bkd_sblastp(state->stack) - 1;
-        bkd_sbpush(newtop->children, n);
+        if (state->handler) {
+            event_popstate(state, frame, n);
+        } else if (state->each && newtop == state->stack) {
+            state->each(state->eachUser, &n);
+            cleanup_node(&n);
+        } else {
+            bkd_sbpush(state->children, n);
+        }
         bkd_sbpop(state->stack);
         return 1;
     } else { /* Otherwise, we are the root frame. */
@@ -386,39 +791,110 @@ static int parse_popstate(struct bkd_parsestate * state) {
     }
 }
 
-/*
- * Return the list type of a line, or 0 if it is not the beginning of a list
- * element. Looks at only the first two characters, and expects that
- * the first character is a list delimiter. That character should either be
- * the end of the line or be followed by whitespace.
- */
-static inline uint32_t get_list_type(struct bkd_string trimmed) {
-    uint32_t listType, codepoint;
-    if (trimmed.length == 0) return 0;
-    switch (trimmed.data[0]) {
-        case '%': listType = BKD_LISTSTYLE_NUMBERED;   break;
-        case '*': listType = BKD_LISTSTYLE_BULLETS;    break;
-        case '-': listType = BKD_LISTSTYLE_ROMAN;      break;
-        case '@': listType = BKD_LISTSTYLE_ALPHA;      break;
-        case '&': listType = BKD_LISTSTYLE_ALPHALOWER; break;
-        case '+': listType = BKD_LISTSTYLE_ROMANLOWER; break;
-        default: return 0;
-    }
-    if (trimmed.length == 1) return listType;
-    codepoint = 0;
-    bkd_utf8_readlen(trimmed.data + 1, &codepoint, trimmed.length - 1);
-    return bkd_utf8_whitespace(codepoint) ? listType : 0;
+/* What parse_dispatch needs to know about a line. Computed once per line
+ * and reused by every state it is dispatched to. */
+struct parse_lineinfo {
+    struct bkd_string trimmed; /* The line without leading whitespace */
+    uint32_t indent;           /* Indent width; tabs count as four */
+    uint32_t run;              /* Repeats of lead at the start of trimmed */
+    uint32_t listType;         /* List style if trimmed starts a list element */
+    uint32_t listIndent;       /* Indent of the text after a list delimiter */
+    uint8_t lead;              /* First byte of trimmed, 0 if empty */
+    uint8_t empty;             /* Only whitespace */
+    uint8_t rule;              /* A run of -, = or . and nothing else */
+};
+
+/* Whitespace bytes, as in bkd_utf8_whitespace. */
+#define LINE_SPACE 1
+/* Possible list delimiters. */
+#define LINE_LIST 2
+/* Possible rule characters. */
+#define LINE_RULE 4
+
+static const uint8_t line_class[256] = {
+    ['\t'] = LINE_SPACE, ['\n'] = LINE_SPACE, ['\v'] = LINE_SPACE,
+    ['\f'] = LINE_SPACE, ['\r'] = LINE_SPACE, [' '] = LINE_SPACE,
+    ['%'] = LINE_LIST, ['*'] = LINE_LIST, ['@'] = LINE_LIST,
+    ['&'] = LINE_LIST, ['+'] = LINE_LIST, ['-'] = LINE_LIST | LINE_RULE,
+    ['='] = LINE_RULE, ['.'] = LINE_RULE
+};
+
+/* Width of leading whitespace from pos, which is moved past it. Whitespace
+ * is always ASCII, so this never needs to decode. Runs of spaces, the usual
+ * indent, are checked eight bytes at a time. */
+static inline uint32_t line_indent(const uint8_t * data, uint32_t length, uint32_t * pos) {
+    const uint64_t spaces = 0x2020202020202020ULL;
+    uint32_t p = *pos;
+    uint32_t indent = 0;
+    uint64_t word;
+    while (p + 8 <= length) {
+        memcpy(&word, data + p, 8);
+        if (word != spaces) break;
+        indent += 8;
+        p += 8;
+    }
+    for (; p < length && (line_class[data[p]] & LINE_SPACE); p++) {
+        if (data[p] == ' ') indent += 1;
+        else if (data[p] == '\t') indent += 4;
+    }
+    *pos = p;
+    return indent;
+}
+
+/* Classify a line in a single pass over its significant prefix. */
+static void parse_classify(struct bkd_string line, struct parse_lineinfo * info) {
+    const uint8_t * data = line.data;
+    uint32_t length = line.length;
+    uint32_t pos = 0;
+    uint32_t end;
+    uint8_t lead;
+    info->indent = line_indent(data, length, &pos);
+    info->run = info->listType = info->listIndent = 0;
+    info->rule = 0;
+    if (pos == length) {
+        info->trimmed = BKD_NULLSTR;
+        info->lead = 0;
+        info->empty = 1;
+        return;
+    }
+    info->trimmed = bkd_strsub(line, pos, -1);
+    info->lead = lead = data[pos];
+    info->empty = 0;
+    for (end = pos + 1; end < length && data[end] == lead; end++)
+        ;
+    info->run = end - pos;
+    if (line_class[lead] & LINE_RULE) {
+        while (end < length && (line_class[data[end]] & LINE_SPACE))
+            end++;
+        info->rule = end == length;
+    }
+    /* A list delimiter is the whole line or followed by whitespace. */
+    if ((line_class[lead] & LINE_LIST) &&
+            (pos + 1 == length || (line_class[data[pos + 1]] & LINE_SPACE))) {
+        switch (lead) {
+            case '%': info->listType = BKD_LISTSTYLE_NUMBERED;   break;
+            case '*': info->listType = BKD_LISTSTYLE_BULLETS;    break;
+            case '-': info->listType = BKD_LISTSTYLE_ROMAN;      break;
+            case '@': info->listType = BKD_LISTSTYLE_ALPHA;      break;
+            case '&': info->listType = BKD_LISTSTYLE_ALPHALOWER; break;
+            default:  info->listType = BKD_LISTSTYLE_ROMANLOWER; break;
+        }
+        end = pos + 1;
+        info->listIndent = line_indent(data, length, &end);
+    }
 }
 
 /* Dispatch a single line to the parser. Returns if the line was consumed. If so,
  * the dispatch will be next with the next line. If not, the dispatch will be called
  * again with the same line (but hopefully different state) */
-static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line) {
-    uint32_t indent = bkd_strindent(line);
+static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line,
+        const struct parse_lineinfo * info) {
+    uint32_t indent = info->indent;
     struct parse_frame * frame = bkd_sblastp(state->stack);
     struct bkd_string trimmed;
     struct bkd_string stripped;
-    int isEmpty = bkd_strempty(line);
+    uint32_t padding;
+    int isEmpty = info->empty;
     switch (frame->ps) {
 
         case PS_SUBDOC:
@@ -433,24 +909,20 @@ static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line)
                 return 0;
             }
             /* Here is where we detect what kind of block comes next. */
-            trimmed = bkd_strtrim_front(line);
-            if (trimmed.data[0] == '#') {
+            if (info->lead == '#') {
                 parse_pushstate(state, indent, PS_HEADER);
-            } else if (bkd_strempty(bkd_strtrimc_front(trimmed, '-')) ||
-                       bkd_strempty(bkd_strtrimc_front(trimmed, '=')) ||
-                       bkd_strempty(bkd_strtrimc_front(trimmed, '.'))) {
+            } else if (info->rule) {
                 parse_pushstate(state, indent, PS_RULE);
-            } else if (trimmed.length >= 3 && trimmed.data[0] == '`' && trimmed.data[1] == '`' && trimmed.data[2] == '`') {
+            } else if (info->lead == '`' && info->run >= 3) {
                 parse_pushstate(state, indent, PS_CODEBLOCK);
-            } else if (trimmed.length >= 2 && trimmed.data[0] == '>') {
+            } else if (info->trimmed.length >= 2 && info->lead == '>') {
                 parse_pushstate(state, indent, PS_BLOCKCOMMENT);
-            } else if (trimmed.length >= 2 && trimmed.data[0] == '|') {
+            } else if (info->trimmed.length >= 2 && info->lead == '|') {
                 parse_pushstate(state, indent, PS_INLINE_GRID);
             } else {
-                uint32_t listtype = get_list_type(trimmed);
-                if (listtype) {
+                if (info->listType) {
                     parse_pushstate(state, indent, PS_LIST);
-                    bkd_sblast(state->stack).node.data.list.style = listtype;
+                    bkd_sblast(state->stack).node.data.list.style = info->listType;
                 } else {
                     parse_pushstate(state, indent, PS_PARAGRAPH);
                 }
@@ -465,12 +937,17 @@ static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line)
             } else if (indent < frame->indent) {
                 parse_popstate(state);
                 return 0;
-            } else if (get_list_type(bkd_strtrim_front(line)) == frame->node.data.list.style) {
-                indent += 1 + bkd_strindent(bkd_strsub(bkd_strtrim_front(line), 1, -1));
+            } else if (info->listType == frame->node.data.list.style) {
+                indent += 1 + info->listIndent;
                 parse_pushstate(state, indent, PS_COLLAPSIBLE_SUBDOC);
                 parse_pushstate(state, indent, PS_LISTITEM);
                 frame = bkd_sblastp(state->stack);
-                frame->buffer = bkd_bufpush(frame->buffer, bkd_strsub(bkd_strtrim_front(line), 2, -1));
+                trimmed = bkd_strsub(info->trimmed, 2, -1);
+                parse_frametext(state, trimmed);
+                /* Continuation lines are joined with a space, unless the
+                 * marker line had no text to join them to. */
+                if (trimmed.length)
+                    frame->userflags |= 1;
                 return 1;
             } else {
                 parse_popstate(state);
@@ -482,27 +959,32 @@ static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line)
                 parse_popstate(state);
                 return 0;
             }
+            padding = 0;
             if (isEmpty) {
                 stripped = BKD_NULLSTR;
             } else {
-                stripped = bkd_strstripn_new(line, frame->indent);
+                /* Only lines with tabs in the indent need a copy. */
+                stripped = bkd_strstripn(line, frame->indent, &padding);
+                if (padding)
+                    stripped = bkd_strstripn_new(line, frame->indent);
             }
             if (frame->useruint == 0) { /* First line */
                 trimmed = bkd_strtrimc_front(stripped, '`');
                 frame->useruint = stripped.length - trimmed.length;
-                trimmed = bkd_strtrim_both(trimmed);
-                frame->node.data.codeblock.language = bkd_strescape_new(trimmed);
-            } else if (stripped.length - bkd_strtrimc_front(stripped, '`').length == frame->useruint) { /* Last line */
+            } else if ((stripped.data == info->trimmed.data ?
+                        (info->lead == '`' ? info->run : 0) :
+                        stripped.length - bkd_strtrimc_front(stripped, '`').length) == frame->useruint) { /* Last line */
                 parse_popstate(state);
             } else {
                 if (frame->userflags & 1) {
-                    frame->buffer = bkd_bufpushc(frame->buffer, '\n');
+                    state->text = bkd_bufpushc(state->text, '\n');
                 } else {
                     frame->userflags |= 1;
                 }
-                frame->buffer = bkd_bufpush(frame->buffer, stripped);
+                state->text = bkd_bufpush(state->text, stripped);
             }
-            bkd_strfree(stripped);
+            if (padding)
+                bkd_strfree(stripped);
             return 1;
 
         case PS_RULE:
@@ -519,7 +1001,7 @@ static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line)
             uint32_t headerSize = line.length - trimmed.length;
             frame->node.data.header.size = headerSize;
             frame->node.type = BKD_HEADER;
-            bkd_parse_line(&frame->node.data.header.text, bkd_strtrim_both(trimmed));
+            parse_viewline(state, &frame->node.data.header.text, bkd_strtrim_both(trimmed));
             parse_popstate(state);
             return 1;
 
@@ -534,10 +1016,11 @@ static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line)
                 return 0;
             }
             if (frame->userflags)
-                frame->buffer = bkd_bufpushc(frame->buffer, ' ');
-            stripped = bkd_strstripn_new(line, frame->indent);
-            frame->buffer = bkd_bufpush(frame->buffer, stripped);
-            bkd_strfree(stripped);
+                state->text = bkd_bufpushc(state->text, ' ');
+            stripped = bkd_strstripn(line, frame->indent, &padding);
+            while (padding--)
+                state->text = bkd_bufpushc(state->text, ' ');
+            parse_frametext(state, stripped);
             frame->userflags |= 1;
             return 1;
 
@@ -546,16 +1029,16 @@ static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line)
                 parse_popstate(state);
                 return isEmpty; /* Consume empty lines but not lines belonging to lower states. */
             }
-            trimmed = bkd_strtrim_front(line);
-            if (trimmed.data[0] != '>') {
+            trimmed = info->trimmed;
+            if (info->lead != '>') {
                 parse_popstate(state);
                 return 0;
             }
             trimmed = bkd_strtrim_front(bkd_strsub(trimmed, 1, -1));
             if (frame->userflags)
-                frame->buffer = bkd_bufpushc(frame->buffer, '\n');
+                state->text = bkd_bufpushc(state->text, '\n');
             frame->userflags |= 1;
-            frame->buffer = bkd_bufpush(frame->buffer, trimmed);
+            parse_frametext(state, trimmed);
             return 1;
 
         case PS_INLINE_GRID:
@@ -563,8 +1046,8 @@ static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line)
                 parse_popstate(state);
                 return isEmpty; /* Consume empty lines but not lines belonging to lower states. */
             }
-            trimmed = bkd_strtrim_front(line);
-            if (trimmed.data[0] != '|') {
+            trimmed = info->trimmed;
+            if (info->lead != '|') {
                 parse_popstate(state);
                 return 0;
             }
@@ -579,21 +1062,23 @@ static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line)
             while (trimmed.length > 0) {
                 const uint32_t pipe = '|';
                 if (find_one(trimmed, &pipe, 1, &nextPipe)) {
-                    struct bkd_string section = bkd_strsub(trimmed, 0, nextPipe - 1);
+                    /* Slice directly - bkd_strsub reads an end index of -1 as the
+                     * whole string, which would hand an empty cell the rest of the row. */
+                    struct bkd_string section = {nextPipe, trimmed.data};
                     /* TODO - not escape trailing whitespace in escape - e.g. \_space_ */
                     section = bkd_strtrim_both(section);
                     struct bkd_node child;
                     child.type = BKD_TEXT;
-                    bkd_parse_line(&child.data.text, section);
-                    bkd_sbpush(frame->children, child);
+                    parse_viewline(state, &child.data.text, section);
+                    bkd_sbpush(state->children, child);
                     sectionCount++;
                 } else {
                     if (bkd_strempty(trimmed)) break;
                     struct bkd_node child;
                     child.type = BKD_TEXT;
                     /* TODO - not escape trailing whitespace in escape - e.g. \_space_ */
-                    bkd_parse_line(&child.data.text, bkd_strtrim_both(trimmed));
-                    bkd_sbpush(frame->children, child);
+                    parse_viewline(state, &child.data.text, bkd_strtrim_both(trimmed));
+                    bkd_sbpush(state->children, child);
                     sectionCount++;
                     break;
                 }
@@ -607,98 +1092,357 @@ static int parse_dispatch(struct bkd_parsestate * state, struct bkd_string line)
     return 1;
 }
 
+/* Checks the UTF-8 of a line as it comes in, then dispatches it until it is
+ * consumed. Everything after can count on valid UTF-8. Invalid lines are
+ * repaired into a copy, which can not be borrowed from. */
+static void parse_feed(struct bkd_parsestate * state, struct bkd_string line) {
+    struct parse_lineinfo info;
+    uint32_t bad;
+    if (bkd_utf8_check(line.data, line.length, &bad) == BKD_UTF8_INVALID) {
+        state->repair.string.length = 0;
+        state->repair = bkd_bufrepair(state->repair, line);
+        line = state->repair.string;
+        state->lineStable = 0;
+    }
+    parse_classify(line, &info);
+    while (!parse_dispatch(state, line, &info))
+        ;
+}
+
 /* Dispatch to a given parse state based on the current line. */
-static inline void parse_main(struct bkd_parsestate * state) {
-    while (!state->in->done) {
-        struct bkd_string line = bkd_getl(state->in);
-        /* Repeatedly dispatch until consumed */
-        while (!parse_dispatch(state, line))
-            ;
+static inline void parse_main(struct bkd_parsestate * state, struct bkd_istream * in) {
+    while (!in->done && !state->error) {
+        struct bkd_string line = bkd_getl(in);
+        /* Only streams that say so keep their lines, and even then lines in
+         * the stream's own buffer get overwritten by the next read. */
+        state->lineStable = state->borrow && (in->type->flags & BKD_ISTREAM_STABLE) &&
+            (line.data < in->buffer.string.data || line.data >= in->buffer.string.data + in->buffer.capacity);
+        parse_feed(state, line);
     }
 }
 
+/* Same as parse_main, but takes lines straight out of a block of memory. */
+static void parse_main_buffer(struct bkd_parsestate * state, uint8_t * data, size_t size,
+        struct bkd_buffer * scratch) {
+    size_t pos = 0;
+    while (pos < size && !state->error) {
+        struct bkd_string line = bkd_strnextline(data, size, &pos, scratch);
+        /* A trailing carriage return on the last line is not a line. */
+        if (line.length == 0 && pos >= size && data[size - 1] != '\n')
+            break;
+        state->lineStable = state->borrow && line.data >= data && line.data < data + size;
+        parse_feed(state, line);
+    }
+}
+
+/* Streams end with an empty line, so do the same for other inputs. */
+static void parse_main_end(struct bkd_parsestate * state) {
+    struct parse_lineinfo info;
+    state->lineStable = 0;
+    parse_classify(BKD_NULLSTR, &info);
+    while (!parse_dispatch(state, BKD_NULLSTR, &info))
+        ;
+}
+
+/* Frees what the parse state allocated for itself. */
+static void parse_release(struct bkd_parsestate * state) {
+    bkd_sbfree(state->stack);
+    bkd_sbfree(state->children);
+    bkd_sbfree(state->segments);
+    bkd_buffree(state->text);
+    bkd_buffree(state->repair);
+    bkd_sbfree(state->lines.nodes);
+    bkd_sbfree(state->lines.levels);
+}
+
+static void parse_begin(struct bkd_parsestate * state, uint32_t options) {
+    state->stack = NULL;
+    state->children = NULL;
+    state->text = (struct bkd_buffer) {0, BKD_NULLSTR};
+    state->repair = (struct bkd_buffer) {0, BKD_NULLSTR};
+    state->lines = (struct parse_linestack) {NULL, NULL};
+    state->arena = NULL;
+    state->segments = NULL;
+    state->borrow = (options & BKD_PARSE_BORROW) != 0;
+    state->lineStable = 0;
+    state->intern = NULL;
+    if (options & BKD_PARSE_ARENA) {
+        bkd_arena_init(&state->arenaStorage);
+        state->arena = &state->arenaStorage;
+    }
+    if (options & BKD_PARSE_INTERN) {
+        bkd_intern_init(&state->internStorage, state->arena);
+        state->intern = &state->internStorage;
+    }
+    state->handler = NULL;
+    state->each = NULL;
+    state->error = 0;
+    parse_pushstate(state, 0, PS_SUBDOC);
+}
+
+/* Documents handed out by the parser. The list comes first, so that a
+ * pointer to it is a pointer to the whole document, and its owner points at
+ * itself, which tells bkd_docfree the document is one of these. */
+struct parse_document {
+    struct bkd_list list;
+    struct bkd_arena arena;
+    struct bkd_intern intern;
+    uint8_t hasArena;
+    uint8_t hasIntern;
+};
+
+static void parse_freelist(struct bkd_list * list, struct bkd_arena * arena, struct bkd_intern * intern);
+
+static struct bkd_list * parse_end(struct bkd_parsestate * state) {
+
+    /* Resolve internal links and anchors */
+
+    /* Set up document */
+    while (parse_popstate(state))
+        ;
+
+    /* A document with parts missing is no document. */
+    struct parse_document * document = state->error ? NULL : BKD_MALLOC(sizeof(struct parse_document));
+    if (!document) {
+        if (!state->error)
+            BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        parse_freelist(&state->stack[0].node.data.list, state->arena, state->intern);
+        parse_release(state);
+        return NULL;
+    }
+    document->list = state->stack[0].node.data.list;
+    document->list.owner = document;
+    document->hasArena = state->arena != NULL;
+    if (state->arena)
+        document->arena = *state->arena;
+    document->hasIntern = state->intern != NULL;
+    if (state->intern) {
+        document->intern = *state->intern;
+        document->intern.arena = state->arena ? &document->arena : NULL;
+    }
+    parse_release(state);
+    return &document->list;
+}
+
 /* Parse a BKDoc input stream and create an AST. */
+struct bkd_list * bkd_parse_opt(struct bkd_istream * in, uint32_t options) {
+    struct bkd_parsestate state;
+    parse_begin(&state, options);
+    parse_main(&state, in);
+    return parse_end(&state);
+}
+
 struct bkd_list * bkd_parse(struct bkd_istream * in) {
+    return bkd_parse_opt(in, 0);
+}
 
+/* Parse a block of memory and create an AST. */
+struct bkd_list * bkd_parse_buffer_opt(const uint8_t * data, size_t size, uint32_t options) {
     struct bkd_parsestate state;
-    state.in = in;
-    state.stack = NULL;
+    struct bkd_buffer scratch = bkd_bufnew(80);
+    parse_begin(&state, options);
+    parse_main_buffer(&state, (uint8_t *) data, size, &scratch);
+    parse_main_end(&state);
+    bkd_buffree(scratch);
+    return parse_end(&state);
+}
 
-    parse_pushstate(&state, 0, PS_SUBDOC);
-    parse_main(&state);
+struct bkd_list * bkd_parse_buffer(const uint8_t * data, size_t size) {
+    return bkd_parse_buffer_opt(data, size, 0);
+}
 
-    /* Resolve internal links and anchors */
+/* Parse a BKDoc input stream, reporting blocks to handler as they complete. */
+int bkd_parse_events(struct bkd_istream * in, const struct bkd_handler * handler) {
+    struct bkd_parsestate state;
+    parse_begin(&state, 0);
+    state.handler = handler;
+    parse_main(&state, in);
+    while (parse_popstate(&state))
+        ;
+    parse_release(&state);
+    return state.error;
+}
 
-    /* Set up document */
+/* Parse a BKDoc input stream, passing each top level node to each as soon
+ * as it is complete. The node is freed when each returns. Returns 0, or the
+ * first error. */
+int bkd_parse_each(struct bkd_istream * in, void (*each)(void * user, struct bkd_node * node), void * user) {
+    struct bkd_parsestate state;
+    parse_begin(&state, 0);
+    state.each = each;
+    state.eachUser = user;
+    parse_main(&state, in);
     while (parse_popstate(&state))
         ;
+    parse_release(&state);
+    return state.error;
+}
 
-    struct bkd_list * document = BKD_MALLOC(sizeof(struct bkd_list));
-    *document = state.stack[0].node.data.list;
-    bkd_sbfree(state.stack);
-    return document;
+/* Push parser. Complete lines are dispatched as soon as they arrive; the
+ * unfinished line at the end of a chunk is kept in carry until its newline
+ * shows up. Lines only break at newlines, so chunks may split UTF-8
+ * sequences anywhere. */
+struct bkd_parser {
+    struct bkd_parsestate state;
+    struct bkd_buffer carry;
+    struct bkd_buffer scratch;
+};
+
+struct bkd_parser * bkd_parser_new(void) {
+    struct bkd_parser * p = BKD_MALLOC(sizeof(struct bkd_parser));
+    if (!p) {
+        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        return NULL;
+    }
+    parse_begin(&p->state, 0);
+    p->carry = bkd_bufnew(80);
+    p->scratch = bkd_bufnew(80);
+    if (!p->carry.string.data)
+        p->carry.capacity = 0;
+    if (!p->scratch.string.data)
+        p->scratch.capacity = 0;
+    return p;
 }
 
-/* recursivley free line nodes */
-static void cleanup_linenode(struct bkd_linenode * l) {
-    if (l->nodeCount > 0) {
-        for (unsigned i = 0; i < l->nodeCount; i++) {
-            cleanup_linenode(l->tree.node + i);
+/* Adds string to the carried line. Grows here, where a failed realloc can be
+ * caught, before bkd_bufpush. */
+static int parser_carry(struct bkd_parser * p, struct bkd_string string) {
+    uint64_t capacity;
+    uint8_t * data;
+    if (p->carry.capacity - p->carry.string.length < string.length) {
+        capacity = 2 * (uint64_t) p->carry.capacity;
+        if (capacity < (uint64_t) p->carry.string.length + string.length)
+            capacity = (uint64_t) p->carry.string.length + string.length;
+        if (capacity > UINT32_MAX || !(data = BKD_REALLOC(p->carry.string.data, capacity))) {
+            parse_fail(&p->state.error, BKD_ERROR_OUT_OF_MEMORY);
+            return 0;
         }
+        p->carry.string.data = data;
+        p->carry.capacity = capacity;
+    }
+    p->carry = bkd_bufpush(p->carry, string);
+    return 1;
+}
+
+int bkd_parser_feed(struct bkd_parser * p, const uint8_t * bytes, size_t n) {
+    uint8_t * data = (uint8_t *) bytes;
+    uint8_t * end = data + n;
+    uint8_t * newline;
+    if (p->state.error || n == 0) return p->state.error;
+    /* Finish the carried line first. */
+    if (p->carry.string.length > 0) {
+        newline = memchr(data, '\n', n);
+        if (!newline) {
+            parser_carry(p, (struct bkd_string) {n, data});
+            return p->state.error;
+        }
+        if (!parser_carry(p, (struct bkd_string) {newline - data + 1, data}))
+            return p->state.error;
+        parse_main_buffer(&p->state, p->carry.string.data, p->carry.string.length, &p->scratch);
+        p->carry.string.length = 0;
+        data = newline + 1;
+    }
+    /* Dispatch all complete lines in place, and carry the rest. */
+    newline = end;
+    while (newline > data && newline[-1] != '\n')
+        newline--;
+    if (newline > data)
+        parse_main_buffer(&p->state, data, newline - data, &p->scratch);
+    if (newline < end)
+        parser_carry(p, (struct bkd_string) {end - newline, newline});
+    return p->state.error;
+}
+
+struct bkd_list * bkd_parser_finish(struct bkd_parser * p) {
+    struct bkd_list * document;
+    if (p->carry.string.length > 0)
+        parse_main_buffer(&p->state, p->carry.string.data, p->carry.string.length, &p->scratch);
+    parse_main_end(&p->state);
+    document = parse_end(&p->state);
+    bkd_buffree(p->carry);
+    bkd_buffree(p->scratch);
+    BKD_FREE(p);
+    return document;
+}
+
+/* Frees what a line node owns, once its children have been freed. */
+static void cleanup_linenode(const struct bkd_linenode * l) {
+    if (l->nodeCount > 0)
         BKD_FREE(l->tree.node);
-    } else {
+    else if (!(l->markup & BKD_BORROWEDLEAF))
         bkd_strfree(l->tree.leaf);
-    }
-    bkd_strfree(l->data);
+    if (!(l->markup & BKD_BORROWEDDATA))
+        bkd_strfree(l->data);
 }
 
-/* Recursively cleanup nodes */
-static void cleanup_node(struct bkd_node * node) {
-    uint32_t max, i;
+/* Frees what a block node owns, once its children have been freed. The text
+ * of paragraphs, headers and comments is a child line node. */
+static void cleanup_block(const struct bkd_node * node) {
     switch (node->type) {
-        case BKD_PARAGRAPH:
-            cleanup_linenode(&node->data.paragraph.text);
-            break;
         case BKD_LIST:
-            max = node->data.list.itemCount;
-            for (i = 0; i < max; i++) {
-                cleanup_node(node->data.list.items + i);
-            }
             BKD_FREE(node->data.list.items);
             break;
         case BKD_TABLE:
-            max = node->data.table.itemCount;
-            for (i = 0; i < max; i++) {
-                cleanup_node(node->data.table.items + i);
-            }
             BKD_FREE(node->data.table.items);
             break;
-        case BKD_HEADER:
-            cleanup_linenode(&node->data.header.text);
-            break;
         case BKD_CODEBLOCK:
             BKD_FREE(node->data.codeblock.text.data);
             if (node->data.codeblock.language.length > 0)
                 BKD_FREE(node->data.codeblock.language.data);
             break;
-        case BKD_COMMENTBLOCK:
-            cleanup_linenode(&node->data.commentblock.text);
-            break;
         case BKD_DATASTRING:
             bkd_strfree(node->data.datastring);
             break;
-        case BKD_TEXT:
-            cleanup_linenode(&node->data.text);
-            break;
         default:
             break;
     }
 }
 
-void bkd_docfree(struct bkd_list * document) {
-    for (uint32_t i = 0; i < document->itemCount; i++) {
-        cleanup_node(document->items + i);
+/* Frees everything in count nodes, children before their parents. */
+static void cleanup_nodes(struct bkd_node * items, uint32_t count) {
+    struct bkd_walk walk;
+    struct bkd_walkframe * f;
+    int event;
+    bkd_walk_init(&walk, items, count);
+    while ((event = bkd_walk_next(&walk))) {
+        if (!(event & BKD_WALK_LEAVE))
+            continue;
+        f = bkd_walk_top(&walk);
+        if (f->line)
+            cleanup_linenode(f->line);
+        else
+            cleanup_block(f->node);
+    }
+    bkd_walk_free(&walk);
+}
+
+static void cleanup_node(struct bkd_node * node) {
+    cleanup_nodes(node, 1);
+}
+
+/* Frees the nodes of a list, or the arena they came from. */
+static void parse_freelist(struct bkd_list * list, struct bkd_arena * arena, struct bkd_intern * intern) {
+    if (intern)
+        bkd_intern_free(intern);
+    if (arena) {
+        bkd_arena_free(arena);
+    } else {
+        cleanup_nodes(list->items, list->itemCount);
+        BKD_FREE(list->items);
+    }
+}
+
+void bkd_docfree(struct bkd_list * list) {
+    struct parse_document * document = (struct parse_document *) list;
+    if (!list)
+        return;
+    if (list->owner != list) {
+        parse_freelist(list, NULL, NULL);
+        BKD_FREE(list);
+        return;
     }
-    BKD_FREE(document->items);
+    parse_freelist(list,
+            document->hasArena ? &document->arena : NULL,
+            document->hasIntern ? &document->intern : NULL);
     BKD_FREE(document);
 }
@@ -0,0 +1,307 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "bkd_scan.h"
+
+#include <string.h>
+
+#if !defined(BKD_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define BKD_SCAN_X86
+#include <immintrin.h>
+#endif
+
+/* Portable versions */
+
+static const uint8_t delim_table[256] = {
+    ['['] = 1, [']'] = 1, ['('] = 1, [')'] = 1, ['|'] = 1, ['\\'] = 1
+};
+
+static uint32_t scan_delim_scalar(const uint8_t * data, uint32_t length) {
+    uint32_t i;
+    for (i = 0; i < length; i++)
+        if (delim_table[data[i]])
+            break;
+    return i;
+}
+
+/* With ascii set, bytes past ASCII are not special. */
+static inline int html_special(uint8_t c, int ascii) {
+    return c < 0x20 || (c >= 0x80 && !ascii) ||
+        c == '<' || c == '>' || c == '&' || c == '"' || c == '\'';
+}
+
+static inline uint32_t scan_html_scalar_impl(const uint8_t * data, uint32_t length, int ascii) {
+    uint32_t i;
+    for (i = 0; i < length; i++)
+        if (html_special(data[i], ascii))
+            break;
+    return i;
+}
+
+#ifndef BKD_SCAN_X86
+static uint32_t scan_html_scalar(const uint8_t * data, uint32_t length) {
+    return scan_html_scalar_impl(data, length, 0);
+}
+
+static uint32_t scan_htmlascii_scalar(const uint8_t * data, uint32_t length) {
+    return scan_html_scalar_impl(data, length, 1);
+}
+#endif
+
+static uint32_t scan_ascii_scalar(const uint8_t * data, uint32_t length) {
+    uint64_t word;
+    uint32_t i;
+    for (i = 0; i + 8 <= length; i += 8) {
+        memcpy(&word, data + i, 8);
+        if (word & 0x8080808080808080ULL)
+            break;
+    }
+    for (; i < length; i++)
+        if (data[i] & 0x80)
+            break;
+    return i;
+}
+
+#ifdef BKD_SCAN_X86
+
+/* The parentheses only differ in their lowest bit, so one compare finds both. */
+
+static uint32_t scan_delim_sse2(const uint8_t * data, uint32_t length) {
+    const __m128i open = _mm_set1_epi8('[');
+    const __m128i close = _mm_set1_epi8(']');
+    const __m128i paren = _mm_set1_epi8('(');
+    const __m128i parenmask = _mm_set1_epi8((char) 0xFE);
+    const __m128i pipe = _mm_set1_epi8('|');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    uint32_t i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hit = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, open), _mm_cmpeq_epi8(v, close)),
+                _mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(v, parenmask), paren),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, pipe), _mm_cmpeq_epi8(v, backslash))));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_delim_scalar(data + i, length - i);
+}
+
+/* Signed compares put bytes of 0x80 and up below 0x20, so one compare
+ * finds control characters and non-ASCII together. Unsigned, through a
+ * minimum, it finds only control characters. Quotes differ in their lowest
+ * bit, as do the angle brackets in their second. */
+
+static inline uint32_t scan_html_sse2_impl(const uint8_t * data, uint32_t length, int ascii) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    const __m128i quote = _mm_set1_epi8('&');
+    const __m128i quotemask = _mm_set1_epi8((char) 0xFE);
+    const __m128i dquote = _mm_set1_epi8('"');
+    const __m128i angle = _mm_set1_epi8('>');
+    const __m128i anglebit = _mm_set1_epi8(2);
+    uint32_t i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i low = ascii ? _mm_cmpeq_epi8(_mm_min_epu8(v, control), v) : _mm_cmplt_epi8(v, space);
+        __m128i hit = _mm_or_si128(
+                _mm_or_si128(low, _mm_cmpeq_epi8(v, dquote)),
+                _mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(v, quotemask), quote),
+                    _mm_cmpeq_epi8(_mm_or_si128(v, anglebit), angle)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_html_scalar_impl(data + i, length - i, ascii);
+}
+
+static uint32_t scan_html_sse2(const uint8_t * data, uint32_t length) {
+    return scan_html_sse2_impl(data, length, 0);
+}
+
+static uint32_t scan_htmlascii_sse2(const uint8_t * data, uint32_t length) {
+    return scan_html_sse2_impl(data, length, 1);
+}
+
+static uint32_t scan_ascii_sse2(const uint8_t * data, uint32_t length) {
+    uint32_t i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(data + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_ascii_scalar(data + i, length - i);
+}
+
+/* Callers of the SSE2 version from AVX2 code must clear the upper halves of
+ * the registers first, or every SSE instruction after pays for a transition. */
+
+__attribute__((target("avx2")))
+static uint32_t scan_delim_avx2(const uint8_t * data, uint32_t length) {
+    if (length < 32)
+        return scan_delim_sse2(data, length);
+    const __m256i open = _mm256_set1_epi8('[');
+    const __m256i close = _mm256_set1_epi8(']');
+    const __m256i paren = _mm256_set1_epi8('(');
+    const __m256i parenmask = _mm256_set1_epi8((char) 0xFE);
+    const __m256i pipe = _mm256_set1_epi8('|');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    uint32_t i;
+    for (i = 0; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i hit = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, open), _mm256_cmpeq_epi8(v, close)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_and_si256(v, parenmask), paren),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, pipe), _mm256_cmpeq_epi8(v, backslash))));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(hit);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return i + scan_delim_sse2(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t scan_html_avx2_impl(const uint8_t * data, uint32_t length, int ascii) {
+    if (length < 32)
+        return scan_html_sse2_impl(data, length, ascii);
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i control = _mm256_set1_epi8(0x1F);
+    const __m256i quote = _mm256_set1_epi8('&');
+    const __m256i quotemask = _mm256_set1_epi8((char) 0xFE);
+    const __m256i dquote = _mm256_set1_epi8('"');
+    const __m256i angle = _mm256_set1_epi8('>');
+    const __m256i anglebit = _mm256_set1_epi8(2);
+    uint32_t i;
+    for (i = 0; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i low = ascii ? _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v) : _mm256_cmpgt_epi8(space, v);
+        __m256i hit = _mm256_or_si256(
+                _mm256_or_si256(low, _mm256_cmpeq_epi8(v, dquote)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_and_si256(v, quotemask), quote),
+                    _mm256_cmpeq_epi8(_mm256_or_si256(v, anglebit), angle)));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(hit);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return i + scan_html_sse2_impl(data + i, length - i, ascii);
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_html_avx2(const uint8_t * data, uint32_t length) {
+    return scan_html_avx2_impl(data, length, 0);
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_htmlascii_avx2(const uint8_t * data, uint32_t length) {
+    return scan_html_avx2_impl(data, length, 1);
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_ascii_avx2(const uint8_t * data, uint32_t length) {
+    uint32_t i;
+    if (length < 32)
+        return scan_ascii_sse2(data, length);
+    for (i = 0; i + 32 <= length; i += 32) {
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(data + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return i + scan_ascii_sse2(data + i, length - i);
+}
+
+#endif
+
+/* Runtime selection. The first call through any scanner picks the versions
+ * for this machine. Racing threads all store the same pointers. */
+
+typedef uint32_t (*scan_fn)(const uint8_t *, uint32_t);
+
+static uint32_t scan_delim_first(const uint8_t * data, uint32_t length);
+static uint32_t scan_ascii_first(const uint8_t * data, uint32_t length);
+static uint32_t scan_html_first(const uint8_t * data, uint32_t length);
+static uint32_t scan_htmlascii_first(const uint8_t * data, uint32_t length);
+
+static scan_fn scan_delim = scan_delim_first;
+static scan_fn scan_ascii = scan_ascii_first;
+static scan_fn scan_html = scan_html_first;
+static scan_fn scan_htmlascii = scan_htmlascii_first;
+
+static void scan_pick(void) {
+#ifdef BKD_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_delim = scan_delim_avx2;
+        scan_ascii = scan_ascii_avx2;
+        scan_html = scan_html_avx2;
+        scan_htmlascii = scan_htmlascii_avx2;
+    } else {
+        scan_delim = scan_delim_sse2;
+        scan_ascii = scan_ascii_sse2;
+        scan_html = scan_html_sse2;
+        scan_htmlascii = scan_htmlascii_sse2;
+    }
+#else
+    scan_delim = scan_delim_scalar;
+    scan_ascii = scan_ascii_scalar;
+    scan_html = scan_html_scalar;
+    scan_htmlascii = scan_htmlascii_scalar;
+#endif
+}
+
+static uint32_t scan_delim_first(const uint8_t * data, uint32_t length) {
+    scan_pick();
+    return scan_delim(data, length);
+}
+
+static uint32_t scan_ascii_first(const uint8_t * data, uint32_t length) {
+    scan_pick();
+    return scan_ascii(data, length);
+}
+
+static uint32_t scan_html_first(const uint8_t * data, uint32_t length) {
+    scan_pick();
+    return scan_html(data, length);
+}
+
+static uint32_t scan_htmlascii_first(const uint8_t * data, uint32_t length) {
+    scan_pick();
+    return scan_htmlascii(data, length);
+}
+
+uint32_t bkd_scan_delim(const uint8_t * data, uint32_t length) {
+    return scan_delim(data, length);
+}
+
+uint32_t bkd_scan_ascii(const uint8_t * data, uint32_t length) {
+    return scan_ascii(data, length);
+}
+
+uint32_t bkd_scan_html(const uint8_t * data, uint32_t length) {
+    return scan_html(data, length);
+}
+
+uint32_t bkd_scan_htmlascii(const uint8_t * data, uint32_t length) {
+    return scan_htmlascii(data, length);
+}
@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef BKD_SCAN_
+#define BKD_SCAN_
+
+#include <stdint.h>
+
+/* Byte scanning kernels. Each scanner returns the offset of the first byte
+ * it is looking for, or length if there is none. On x86 with GCC or Clang,
+ * SSE2 and AVX2 versions are picked at runtime. Define BKD_NO_SIMD to only
+ * use the portable versions. */
+
+/* Finds the next [ ] ( ) | or backslash. */
+uint32_t bkd_scan_delim(const uint8_t * data, uint32_t length);
+
+/* Finds the next byte that is not ASCII. */
+uint32_t bkd_scan_ascii(const uint8_t * data, uint32_t length);
+
+/* Finds the next byte that HTML text can not hold as it is: < > & " ',
+ * control characters and anything not ASCII. */
+uint32_t bkd_scan_html(const uint8_t * data, uint32_t length);
+
+/* Same as bkd_scan_html, but lets bytes past ASCII through. */
+uint32_t bkd_scan_htmlascii(const uint8_t * data, uint32_t length);
+
+#endif /* end of include guard: BKD_SCAN_ */
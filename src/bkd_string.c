@@ -100,10 +100,20 @@ struct bkd_string bkd_strconcat_new(struct bkd_string str1, struct bkd_string st
     return ret;
 }
 
+/* Whitespace is all ASCII, and bytes of longer characters are never ASCII,
+ * so the helpers below that look for whitespace or an ASCII codepoint work
+ * on bytes. They only decode to look for other codepoints. */
+
 int bkd_strfind(struct bkd_string string, uint32_t codepoint, uint32_t * index) {
     uint32_t pos = 0;
     uint32_t testpoint = 0;
     uint32_t charsize;
+    if (codepoint < 0x80) {
+        uint8_t * found = string.length ? memchr(string.data, codepoint, string.length) : NULL;
+        if (!found) return 0;
+        *index = found - string.data;
+        return 1;
+    }
     while (pos < string.length) {
         charsize = bkd_utf8_readlen(string.data + pos, &testpoint, string.length - pos);
         if (testpoint == codepoint) {
@@ -117,21 +127,12 @@ int bkd_strfind(struct bkd_string string, uint32_t codepoint, uint32_t * index)
 
 uint32_t bkd_strindent(struct bkd_string string) {
     uint32_t indent = 0;
-    uint32_t pos = 0;
-    uint32_t codepoint = 0;
-    while (pos < string.length) {
-        if (string.data[pos] == ' ') {
+    uint32_t pos;
+    for (pos = 0; pos < string.length && BKD_UTF8_WHITESPACE(string.data[pos]); pos++) {
+        if (string.data[pos] == ' ')
             indent += 1;
-            pos++;
-        } else if (string.data[pos] == '\t') {
+        else if (string.data[pos] == '\t')
             indent += 4;
-            pos++;
-        } else {
-            pos += bkd_utf8_readlen(string.data + pos, &codepoint, string.length - pos);
-            if (!bkd_utf8_whitespace(codepoint)) {
-                break;
-            }
-        }
     }
     return indent;
 }
@@ -148,46 +149,79 @@ int bkd_strequal(struct bkd_string str1, struct bkd_string str2) {
 }
 
 int bkd_strempty(struct bkd_string string) {
-    uint32_t pos = 0;
-    uint32_t codepoint = 0;
-    while (pos < string.length) {
-        pos += bkd_utf8_readlen(string.data + pos, &codepoint, string.length - pos);
-        if (!bkd_utf8_whitespace(codepoint)) {
+    uint32_t pos;
+    for (pos = 0; pos < string.length; pos++)
+        if (!BKD_UTF8_WHITESPACE(string.data[pos]))
             return 0;
-        }
-    }
     return 1;
 }
 
+static inline uint32_t hash_rotl(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+/* MurmurHash3 (x86, 32 bit). Mixes four bytes at a time. */
 uint32_t bkd_strhash(struct bkd_string string) {
-    uint8_t * dataEnd = string.data + string.length;
-    uint8_t * data;
-    uint32_t hash = 5381;
-    for (data = string.data; data < dataEnd; ++data)
-        hash = 33 * hash + *data;
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    uint32_t hash = 0x9747b28c;
+    uint32_t k, i;
+    uint32_t blocks = string.length / 4;
+    const uint8_t * tail = string.data + blocks * 4;
+    for (i = 0; i < blocks; i++) {
+        memcpy(&k, string.data + 4 * i, 4);
+        k *= c1;
+        k = hash_rotl(k, 15);
+        k *= c2;
+        hash ^= k;
+        hash = hash_rotl(hash, 13);
+        hash = hash * 5 + 0xe6546b64;
+    }
+    k = 0;
+    switch (string.length & 3) {
+        case 3: k ^= (uint32_t) tail[2] << 16; /* fallthrough */
+        case 2: k ^= (uint32_t) tail[1] << 8; /* fallthrough */
+        case 1:
+            k ^= tail[0];
+            k *= c1;
+            k = hash_rotl(k, 15);
+            k *= c2;
+            hash ^= k;
+    }
+    hash ^= string.length;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
     return hash;
 }
 
-struct bkd_string bkd_strstripn_new(struct bkd_string string, uint32_t n) {
-    struct bkd_string ret;
+struct bkd_string bkd_strstripn(struct bkd_string string, uint32_t n, uint32_t * padding) {
     uint32_t leading = 0;
     uint32_t pos = 0;
-    uint32_t padding = 0;
     uint32_t codepoint = 0;
-    if (string.length < 1) return string;
+    *padding = 0;
     while (leading < n && pos < string.length) {
-        pos += bkd_utf8_readlen(string.data + pos, &codepoint, string.length - pos);
-        if (codepoint == '\t') {
-            leading += 4;
+        if (string.data[pos] < 0x80) {
+            leading += string.data[pos++] == '\t' ? 4 : 1;
         } else {
+            pos += bkd_utf8_readlen(string.data + pos, &codepoint, string.length - pos);
             leading++;
         }
     }
-    if (leading < n) {
-        return bkd_cstr_new("");
-    }
-    padding = leading - n;
-    uint32_t newlen = string.length - pos + padding;
+    if (leading < n)
+        return BKD_NULLSTR;
+    *padding = leading - n;
+    return (struct bkd_string) {string.length - pos, string.data + pos};
+}
+
+struct bkd_string bkd_strstripn_new(struct bkd_string string, uint32_t n) {
+    struct bkd_string ret;
+    struct bkd_string rest;
+    uint32_t padding;
+    if (string.length < 1) return string;
+    rest = bkd_strstripn(string, n, &padding);
+    uint32_t newlen = rest.length + padding;
     if (newlen == 0) {
         return bkd_cstr_new("");
     }
@@ -195,31 +229,19 @@ struct bkd_string bkd_strstripn_new(struct bkd_string string, uint32_t n) {
     ret.data = BKD_MALLOC(newlen);
     for (uint32_t i = 0; i < padding; i++)
         ret.data[i] = ' ';
-    memcpy(ret.data + padding, string.data + pos, newlen - padding);
+    memcpy(ret.data + padding, rest.data, rest.length);
     return ret;
 }
 
 struct bkd_string bkd_strtrim(struct bkd_string string, int front, int back) {
     uint8_t * head = string.data;
     uint8_t * tail = head + string.length;
-    uint32_t codepoint;
-    uint32_t charsize;
-    if (front) {
-        while (head < tail) {
-            charsize = bkd_utf8_readlen(head, &codepoint, tail - head);
-            if (!bkd_utf8_whitespace(codepoint))
-                break;
-            head += charsize;
-        }
-    }
-    if (back) {
-        while (head < tail) {
-            charsize = bkd_utf8_readlenback(tail, &codepoint, tail - head);
-            if (!bkd_utf8_whitespace(codepoint))
-                break;
-            tail -= charsize;
-        }
-    }
+    if (front)
+        while (head < tail && BKD_UTF8_WHITESPACE(*head))
+            head++;
+    if (back)
+        while (head < tail && BKD_UTF8_WHITESPACE(tail[-1]))
+            tail--;
     string.data = head;
     string.length = tail - head;
     if (string.length == 0) return BKD_NULLSTR;
@@ -231,20 +253,29 @@ struct bkd_string bkd_strtrimc(struct bkd_string string, uint32_t codepoint, int
     uint8_t * tail = head + string.length;
     uint32_t testpoint;
     uint32_t charsize;
-    if (front) {
-        while (head < tail) {
-            charsize = bkd_utf8_readlen(head, &testpoint, tail - head);
-            if (testpoint != codepoint)
-                break;
-            head += charsize;
+    if (codepoint < 0x80) {
+        if (front)
+            while (head < tail && *head == codepoint)
+                head++;
+        if (back)
+            while (head < tail && tail[-1] == codepoint)
+                tail--;
+    } else {
+        if (front) {
+            while (head < tail) {
+                charsize = bkd_utf8_readlen(head, &testpoint, tail - head);
+                if (testpoint != codepoint)
+                    break;
+                head += charsize;
+            }
         }
-    }
-    if (back) {
-        while (head < tail) {
-            charsize = bkd_utf8_readlenback(tail, &testpoint, tail - head);
-            if (testpoint != codepoint)
-                break;
-            tail -= charsize;
+        if (back) {
+            while (head < tail) {
+                charsize = bkd_utf8_readlenback(tail, &testpoint, tail - head);
+                if (testpoint != codepoint)
+                    break;
+                tail -= charsize;
+            }
         }
     }
     string.data = head;
@@ -253,6 +284,37 @@ struct bkd_string bkd_strtrimc(struct bkd_string string, uint32_t codepoint, int
     return string;
 }
 
+struct bkd_string bkd_strnextline(uint8_t * data, size_t size, size_t * pos, struct bkd_buffer * scratch) {
+    struct bkd_string ret;
+    uint8_t * head = data + *pos;
+    uint8_t * end = data + size;
+    uint8_t * newline = memchr(head, '\n', end - head);
+    uint8_t * cr;
+    if (newline) {
+        *pos = newline - data + 1;
+    } else {
+        newline = end;
+        *pos = size;
+    }
+    ret.data = head;
+    ret.length = newline - head;
+    cr = memchr(head, '\r', ret.length);
+    if (!cr) return ret;
+    if (cr == newline - 1) {
+        ret.length--;
+        return ret;
+    }
+    /* Interior carriage returns, so copy the line without them. */
+    scratch->string.length = 0;
+    while (cr) {
+        *scratch = bkd_bufpush(*scratch, (struct bkd_string) {cr - head, head});
+        head = cr + 1;
+        cr = memchr(head, '\r', newline - head);
+    }
+    *scratch = bkd_bufpush(*scratch, (struct bkd_string) {newline - head, head});
+    return scratch->string;
+}
+
 void bkd_strfree(struct bkd_string string) {
     if (string.data) {
         BKD_FREE(string.data);
@@ -307,3 +369,14 @@ struct bkd_buffer bkd_bufpushb(struct bkd_buffer buffer, uint8_t byte) {
     buffer.string.data[buffer.string.length - 1] = byte;;
     return buffer;
 }
+
+struct bkd_buffer bkd_bufrepair(struct bkd_buffer buffer, struct bkd_string string) {
+    uint32_t bad;
+    while (bkd_utf8_check(string.data, string.length, &bad) == BKD_UTF8_INVALID) {
+        buffer = bkd_bufpush(buffer, (struct bkd_string) {bad, string.data});
+        buffer = bkd_bufpushc(buffer, BKD_UTF8_REPLACEMENT);
+        string.data += bad + 1;
+        string.length -= bad + 1;
+    }
+    return bkd_bufpush(buffer, string);
+}
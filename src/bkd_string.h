@@ -64,6 +64,10 @@ int bkd_strempty(struct bkd_string string);
  */
 struct bkd_string bkd_strstripn_new(struct bkd_string string, uint32_t n);
 
+/* Same as bkd_strstripn_new, but returns the rest of string in place. Spaces
+ * left over from a partly stripped tab are counted in padding. */
+struct bkd_string bkd_strstripn(struct bkd_string string, uint32_t n, uint32_t * padding);
+
 /* Trims whitespace from beginning and end of string. */
 struct bkd_string bkd_strtrim(struct bkd_string string, int front, int back);
 
@@ -78,6 +82,12 @@ struct bkd_string bkd_strtrimc(struct bkd_string string, uint32_t codepoint, int
 #define bkd_strtrimc_back(S, C) bkd_strtrimc((S), (C), 0, 1)
 #define bkd_strtrimc_both(S, C) bkd_strtrimc((S), (C), 1, 1)
 
+/* Gets the line starting at *pos in a block of memory, and advances *pos past
+ * the line ending. Carriage returns are removed. Lines are returned as views
+ * into data unless they contain a carriage return before the end, in which
+ * case they are copied into scratch. */
+struct bkd_string bkd_strnextline(uint8_t * data, size_t size, size_t * pos, struct bkd_buffer * scratch);
+
 /* Frees a string. */
 void bkd_strfree(struct bkd_string string);
 
@@ -94,4 +104,8 @@ struct bkd_buffer bkd_bufpushc(struct bkd_buffer buffer, uint32_t codepoint);
 
 struct bkd_buffer bkd_bufpushb(struct bkd_buffer buffer, uint8_t byte);
 
+/* Push a string with every byte that does not start a valid UTF-8 character
+ * replaced by U+FFFD */
+struct bkd_buffer bkd_bufrepair(struct bkd_buffer buffer, struct bkd_string string);
+
 #endif /* end of include guard: BKD_STRING_H_EFHP8VH0 */
@@ -20,6 +20,7 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #include "bkd_utf8.h"
+#include "bkd_scan.h"
 #include <string.h>
 
 /**
@@ -102,60 +103,112 @@ size_t bkd_utf8_writelen(uint8_t * s, uint32_t value, uint32_t maxlen) {
     return size;
 }
 
+/* Smallest codepoint for each sequence length. Anything below is overlong. */
+static const uint32_t utf8_min[5] = {0, 0, 0x80, 0x800, 0x10000};
+
 /**
  * Reads string s into ret. Returns the amount of memory read into. Can be up to 4 bytes.
+ * Expects the whole sequence to be in memory; use bkd_utf8_readlen otherwise.
  */
 size_t bkd_utf8_read(uint8_t * s, uint32_t * ret) {
-    uint8_t head = *s;
-    if ((head & 0x80) == 0) {
-        *ret = head;
-        return 1;
-    } else if ((head & 0xE0) == 0xC0) {
-        *ret = (s[1] & 0x3F) + ((head & 0x0F) << 6);
-        return 2;
-    } else if ((head & 0xF0) == 0xE0) {
-        *ret = (s[2] & 0x3F) + ((s[1] & 0x3F) << 6) + ((head & 0x1F) << 12);
-        return 3;
-    } else if ((head & 0xF8) == 0xF0) {
-        *ret = (s[3] & 0x3F) + ((s[2] & 0x3F) << 6) + ((s[1] & 0x3F) << 12) + ((head & 0x07) << 18);
-        return 4;
-    } else {
-        return 0;
-    }
+    size_t size = bkd_utf8_sizeb(s[0]);
+    return bkd_utf8_readlen(s, ret, size ? size : 1);
 }
 
 /**
- * Same as bkd_utf8_read, but will only read maxlen bytes at most. If the character
- * being read is too long, this function will return the length of the current character.
+ * Same as bkd_utf8_read, but will only read maxlen bytes at most. A sequence
+ * that is malformed, overlong, a surrogate, out of range or cut off by maxlen
+ * reads as U+FFFD and is one byte long. Returns 0 only if maxlen is 0.
  */
 size_t bkd_utf8_readlen(uint8_t * s, uint32_t * ret, uint32_t maxlen) {
-    size_t size = bkd_utf8_sizeb(s[0]);
-    if (size <= maxlen)
-        return bkd_utf8_read(s, ret);
+    size_t size, i;
+    uint32_t value;
+    if (maxlen == 0)
+        return 0;
+    if (s[0] < 0x80) {
+        *ret = s[0];
+        return 1;
+    }
+    size = bkd_utf8_sizeb(s[0]);
+    if (size < 2 || size > maxlen)
+        goto invalid;
+    value = s[0] & (0x7F >> size);
+    for (i = 1; i < size; i++) {
+        if ((s[i] & 0xC0) != 0x80)
+            goto invalid;
+        value = (value << 6) | (s[i] & 0x3F);
+    }
+    if (value < utf8_min[size] || value > BKD_UTF8_MAXCODEPOINT ||
+            (value >= 0xD800 && value < 0xE000))
+        goto invalid;
+    *ret = value;
     return size;
+invalid:
+    *ret = BKD_UTF8_REPLACEMENT;
+    return 1;
 }
 
+/**
+ * Reads the character that ends just before s, looking back at most maxback
+ * bytes. Bytes that do not end a whole character read as U+FFFD, one at a time.
+ */
 size_t bkd_utf8_readlenback(uint8_t * s, uint32_t * ret, uint32_t maxback) {
-    uint8_t * head = bkd_utf8_findhead(s - 1, s - maxback);
-    uint32_t len = s - head;
-    return bkd_utf8_readlen(head, ret, len);
+    uint8_t * head;
+    uint32_t len;
+    if (maxback == 0)
+        return 0;
+    head = bkd_utf8_findhead(s - 1, s - maxback);
+    len = s - head;
+    if (bkd_utf8_readlen(head, ret, len) != len) {
+        *ret = BKD_UTF8_REPLACEMENT;
+        return 1;
+    }
+    return len;
 }
 
 size_t bkd_utf8_readback(uint8_t * s, uint32_t * ret) {
     return bkd_utf8_readlenback(s, ret, 4);
 }
 
+/**
+ * Checks that a string is valid UTF-8. Returns BKD_UTF8_ASCII, BKD_UTF8_VALID
+ * or BKD_UTF8_INVALID. If invalid, bad is set to the offset of the first
+ * byte that does not start a valid character.
+ */
+int bkd_utf8_check(const uint8_t * s, uint32_t length, uint32_t * bad) {
+    uint32_t pos = bkd_scan_ascii(s, length);
+    uint32_t codepoint;
+    size_t size;
+    int result = BKD_UTF8_ASCII;
+    while (pos < length) {
+        result = BKD_UTF8_VALID;
+        size = bkd_utf8_readlen((uint8_t *) s + pos, &codepoint, length - pos);
+        if (size == 1) {
+            *bad = pos;
+            return BKD_UTF8_INVALID;
+        }
+        pos += size;
+        pos += bkd_scan_ascii(s + pos, length - pos);
+    }
+    return result;
+}
+
 /***
  * Helpers
  */
 
+/**
+ * Finds the first byte of the character that s is part of, without going
+ * before start. If there is no head within reach, returns s.
+ */
 uint8_t * bkd_utf8_findhead(uint8_t * s, uint8_t * start) {
-    while ((*s & 0xC0) == 0x80) {
-        if (s < start)
-            return NULL;
-        --s;
+    uint8_t * head = s;
+    while ((*head & 0xC0) == 0x80) {
+        if (head == start || s - head == 3)
+            return s;
+        --head;
     }
-    return s;
+    return head;
 }
 
 /**
@@ -163,5 +216,5 @@ uint8_t * bkd_utf8_findhead(uint8_t * s, uint8_t * start) {
  */
 int bkd_utf8_whitespace(uint32_t codepoint) {
     /* There might be some other unicode to consider later, in the higher regions. */
-    return (codepoint > 8 && codepoint < 14) || codepoint == 32;
+    return BKD_UTF8_WHITESPACE(codepoint);
 }
@@ -26,6 +26,12 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stddef.h>
 
 #define BKD_UTF8_MAXCODEPOINT 0x10FFFF
+#define BKD_UTF8_REPLACEMENT 0xFFFD
+
+/* Results of bkd_utf8_check */
+#define BKD_UTF8_ASCII 0
+#define BKD_UTF8_VALID 1
+#define BKD_UTF8_INVALID 2
 
 uint8_t * bkd_utf8_findhead(uint8_t * s, uint8_t * start);
 size_t bkd_utf8_sizep(uint32_t codepoint);
@@ -36,9 +42,14 @@ size_t bkd_utf8_read(uint8_t * s, uint32_t * ret);
 size_t bkd_utf8_readlen(uint8_t * s, uint32_t * ret, uint32_t maxlen);
 size_t bkd_utf8_readlenback(uint8_t * s, uint32_t * ret, uint32_t maxback);
 size_t bkd_utf8_readback(uint8_t * s, uint32_t * ret);
+int bkd_utf8_check(const uint8_t * s, uint32_t length, uint32_t * bad);
 
 /* Helper functions */
 
+/* Whitespace is all ASCII, so this works on single bytes of UTF-8 as well as
+ * on codepoints. It is a macro so that byte loops can inline it. */
+#define BKD_UTF8_WHITESPACE(c) (((c) > 8 && (c) < 14) || (c) == 32)
+
 int bkd_utf8_whitespace(uint32_t codepoint);
 
 #endif /* end of include guard: BKD_UTF8_ */
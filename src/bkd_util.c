@@ -19,18 +19,35 @@ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#ifndef BKD_NO_POSIX
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "bkd.h"
 #include "bkd_utf8.h"
 #include "bkd_string.h"
 #include <string.h>
+#include <stdlib.h>
+
+#if !defined(BKD_NO_STDIO) && !defined(BKD_NO_POSIX)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
 /* Error strings */
 const char * bkd_errors[] = {
     NULL,
     "Out of memory.",
     "Invalid markup type.",
+    "Invalid markup pattern.",
     "Unknown node type.",
-    "Unknown error."
+    "Unknown error.",
+    "I/O error."
 };
 
 /* Output streams */
@@ -61,6 +78,12 @@ void bkd_flush(struct bkd_ostream * out) {
         out->type->flush(out);
 }
 
+void bkd_ostream_close(struct bkd_ostream * out) {
+    bkd_flush(out);
+    if (out->type->close)
+        out->type->close(out);
+}
+
 /* Input streams */
 
 struct bkd_istream * bkd_istream_init(struct bkd_istreamdef * type, struct bkd_istream * stream, void * user) {
@@ -68,6 +91,8 @@ struct bkd_istream * bkd_istream_init(struct bkd_istreamdef * type, struct bkd_i
     stream->user = user;
     stream->done = 0;
     stream->buffer = bkd_bufnew(80);
+    stream->line = BKD_NULLSTR;
+    stream->offset = 0;
     return stream;
 }
 
@@ -75,6 +100,12 @@ void bkd_istream_freebuf(struct bkd_istream * in) {
     bkd_buffree(in->buffer);
 }
 
+void bkd_istream_close(struct bkd_istream * in) {
+    if (in->type && in->type->close)
+        in->type->close(in);
+    bkd_istream_freebuf(in);
+}
+
 struct bkd_string bkd_getl(struct bkd_istream * in) {
     if (in->done)
         return BKD_NULLSTR;
@@ -84,19 +115,146 @@ struct bkd_string bkd_getl(struct bkd_istream * in) {
 
 struct bkd_string bkd_lastl(struct bkd_istream * in) {
     if (!in->done) {
-        return in->buffer.string;
+        return in->line;
     } else {
         return BKD_NULLSTR;
     }
 }
 
+/* In memory input stream. Lines are views into the memory, which
+ * must outlive the stream. Also used for memory mapped files. */
+
+struct memory_state {
+    uint8_t * base;
+    size_t size;
+    size_t pos;
+};
+
+static int memory_getl(struct bkd_istream * in) {
+    struct memory_state * state = (struct memory_state *) in->user;
+    if (state->pos >= state->size) {
+        in->done = 1;
+        return 0;
+    }
+    in->line = bkd_strnextline(state->base, state->size, &state->pos, &in->buffer);
+    /* A trailing carriage return on the last line is not a line. */
+    if (in->line.length == 0 && state->pos >= state->size && state->base[state->size - 1] != '\n') {
+        in->done = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static void memory_close(struct bkd_istream * in) {
+    BKD_FREE(in->user);
+    in->user = NULL;
+}
+
+static struct bkd_istreamdef _bkd_string_istreamdef = {
+    memory_getl,
+    memory_close,
+    BKD_ISTREAM_STABLE
+};
+
+struct bkd_istream bkd_string_istream(struct bkd_string string) {
+    struct bkd_istream stream;
+    struct memory_state * state = BKD_MALLOC(sizeof(struct memory_state));
+    bkd_istream_init(&_bkd_string_istreamdef, &stream, state);
+    if (!state) {
+        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        stream.done = 1;
+        return stream;
+    }
+    state->base = string.data;
+    state->size = string.length;
+    state->pos = 0;
+    return stream;
+}
+
+/* In memory output stream. Grows as needed. If memory runs out, writes
+ * fail with BKD_ERROR_OUT_OF_MEMORY and the output so far is kept. */
+
+/* Starts the buffer over empty. A buffer that could not be allocated has
+ * no capacity, so the next write tries again. */
+static void string_reset(struct bkd_buffer * buffer) {
+    *buffer = bkd_bufnew(256);
+    if (!buffer->string.data)
+        buffer->capacity = 0;
+}
+
+static int string_put(struct bkd_ostream * out, struct bkd_string string) {
+    struct bkd_buffer * buffer = (struct bkd_buffer *) out->user;
+    uint32_t capacity;
+    uint8_t * data;
+    if (!buffer)
+        return BKD_ERROR_OUT_OF_MEMORY;
+    /* Grow here, where a failed realloc can be caught, before bkd_bufpush. */
+    if (buffer->capacity - buffer->string.length < string.length) {
+        capacity = 1.5 * (buffer->string.length + string.length) + 1;
+        data = BKD_REALLOC(buffer->string.data, capacity);
+        if (!data) {
+            BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+            return BKD_ERROR_OUT_OF_MEMORY;
+        }
+        buffer->string.data = data;
+        buffer->capacity = capacity;
+    }
+    *buffer = bkd_bufpush(*buffer, string);
+    return 0;
+}
+
+static void string_close(struct bkd_ostream * out) {
+    struct bkd_buffer * buffer = (struct bkd_buffer *) out->user;
+    if (!buffer)
+        return;
+    bkd_buffree(*buffer);
+    BKD_FREE(buffer);
+    out->user = NULL;
+}
+
+static struct bkd_ostreamdef _bkd_string_ostreamdef = {
+    string_put,
+    NULL,
+    string_close
+};
+
+struct bkd_ostream bkd_string_ostream(void) {
+    struct bkd_ostream stream;
+    struct bkd_buffer * buffer = BKD_MALLOC(sizeof(struct bkd_buffer));
+    if (!buffer)
+        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+    else
+        string_reset(buffer);
+    stream.type = &_bkd_string_ostreamdef;
+    stream.user = buffer;
+    return stream;
+}
+
+/* Takes the output so far. The stream starts over empty. */
+struct bkd_string bkd_string_ostream_take(struct bkd_ostream * out) {
+    struct bkd_buffer * buffer = (struct bkd_buffer *) out->user;
+    struct bkd_string ret;
+    if (!buffer)
+        return BKD_NULLSTR;
+    ret = buffer->string;
+    string_reset(buffer);
+    if (ret.length == 0) {
+        bkd_strfree(ret);
+        return BKD_NULLSTR;
+    }
+    return ret;
+}
+
+struct bkd_istreamdef * BKD_STRING_ISTREAMDEF = &_bkd_string_istreamdef;
+struct bkd_ostreamdef * BKD_STRING_OSTREAMDEF = &_bkd_string_ostreamdef;
+
 #ifndef BKD_NO_STDIO
 
 /* stdio output stream */
 
 static int file_put_impl(FILE * file, struct bkd_string string) {
-    for (uint32_t i = 0; i < string.length; i++)
-        fputc(string.data[i], file);
+    if (fwrite(string.data, 1, string.length, file) != string.length)
+        return BKD_ERROR_IO;
     return 0;
 }
 
@@ -109,19 +267,164 @@ static int file_flush(struct bkd_ostream * out) {
     return 0;
 }
 
+static struct bkd_ostreamdef _bkd_file_ostreamdef = {
+    file_put,
+    file_flush,
+    NULL
+};
+
+struct bkd_ostreamdef * BKD_FILE_OSTREAMDEF = &_bkd_file_ostreamdef;
+
+#ifndef BKD_NO_POSIX
+
+/* Buffered file descriptor output stream */
+
+#ifndef BKD_STDOUT_BLOCKSIZE
+#define BKD_STDOUT_BLOCKSIZE 65536
+#endif
+
+struct fd_ostate {
+    int fd;
+    uint32_t length;
+    uint32_t capacity;
+    uint8_t * data;
+};
+
+/* Write all of iov, retrying on short writes and interrupts. */
+static int fd_writeall(int fd, struct iovec * iov, int count) {
+    ssize_t n;
+    while (count > 0) {
+        n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return BKD_ERROR_IO;
+        }
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int fd_flush(struct bkd_ostream * out) {
+    struct fd_ostate * state = (struct fd_ostate *) out->user;
+    struct iovec iov;
+    int error;
+    if (state->length == 0) return 0;
+    iov.iov_base = state->data;
+    iov.iov_len = state->length;
+    error = fd_writeall(state->fd, &iov, 1);
+    state->length = 0;
+    return error;
+}
+
+static int fd_put(struct bkd_ostream * out, struct bkd_string string) {
+    struct fd_ostate * state = (struct fd_ostate *) out->user;
+    struct iovec iov[2];
+    int error;
+    if (string.length <= state->capacity - state->length) {
+        memcpy(state->data + state->length, string.data, string.length);
+        state->length += string.length;
+        return 0;
+    }
+    /* Large writes skip the block entirely. */
+    if (string.length >= state->capacity) {
+        iov[0].iov_base = state->data;
+        iov[0].iov_len = state->length;
+        iov[1].iov_base = string.data;
+        iov[1].iov_len = string.length;
+        state->length = 0;
+        return fd_writeall(state->fd, iov, 2);
+    }
+    if ((error = fd_flush(out)))
+        return error;
+    memcpy(state->data, string.data, string.length);
+    state->length = string.length;
+    return 0;
+}
+
+static void fd_close(struct bkd_ostream * out) {
+    BKD_FREE(out->user);
+    out->user = NULL;
+}
+
+static struct bkd_ostreamdef _bkd_fd_ostreamdef = {
+    fd_put,
+    fd_flush,
+    fd_close
+};
+
+struct bkd_ostream * bkd_fd_ostream(struct bkd_ostream * stream, int fd, uint32_t blocksize) {
+    struct fd_ostate * state = BKD_MALLOC(sizeof(struct fd_ostate) + blocksize);
+    if (!state) {
+        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        return NULL;
+    }
+    state->fd = fd;
+    state->length = 0;
+    state->capacity = blocksize;
+    state->data = (uint8_t *) (state + 1);
+    stream->type = &_bkd_fd_ostreamdef;
+    stream->user = state;
+    return stream;
+}
+
+/* Standard out shares the fd stream implementation with a static block. Output
+ * left in the block is written at exit, as stdio would. */
+
+static uint8_t _bkd_stdout_block[BKD_STDOUT_BLOCKSIZE];
+
+static struct fd_ostate _bkd_stdout_state = {
+    1,
+    0,
+    BKD_STDOUT_BLOCKSIZE,
+    _bkd_stdout_block
+};
+
+static struct bkd_ostream _bkd_stdout;
+
+static void stdout_atexit(void) {
+    fd_flush(&_bkd_stdout);
+}
+
 static int stdout_put(struct bkd_ostream * out, struct bkd_string string) {
-    out->user = stdout;
-    return file_put(out, string);
+    static int registered = 0;
+    if (!registered) {
+        registered = 1;
+        fflush(stdout);
+        atexit(stdout_atexit);
+    }
+    return fd_put(out, string);
 }
 
-static struct bkd_ostreamdef _bkd_file_ostreamdef = {
-    file_put,
-    file_flush
+static struct bkd_ostreamdef _bkd_stdout_def = {
+    stdout_put,
+    fd_flush,
+    NULL
 };
 
+static struct bkd_ostream _bkd_stdout = {
+    &_bkd_stdout_def,
+    &_bkd_stdout_state
+};
+
+#else
+
+static int stdout_put(struct bkd_ostream * out, struct bkd_string string) {
+    out->user = stdout;
+    return file_put(out, string);
+}
+
 static struct bkd_ostreamdef _bkd_stdout_def = {
     stdout_put,
-    file_flush
+    file_flush,
+    NULL
 };
 
 static struct bkd_ostream _bkd_stdout = {
@@ -129,30 +432,113 @@ static struct bkd_ostream _bkd_stdout = {
     NULL
 };
 
-struct bkd_ostreamdef * BKD_FILE_OSTREAMDEF = &_bkd_file_ostreamdef;
+#endif
+
 struct bkd_ostream * BKD_STDOUT = &_bkd_stdout;
 
 /* stdio input stream */
 
-/* Switch to buffered reads with fread */
+/* Size of the blocks read from files. Lines longer than this grow the buffer. */
+#ifndef BKD_FILE_BLOCKSIZE
+#define BKD_FILE_BLOCKSIZE 65536
+#endif
+
+/* Remove carriage returns from a line in place. */
+static struct bkd_string strip_cr(struct bkd_string line) {
+    uint8_t * end = line.data + line.length;
+    uint8_t * cr, * write, * next;
+    if (line.length == 0) return line;
+    cr = memchr(line.data, '\r', line.length);
+    if (!cr) return line;
+    if (cr == end - 1) {
+        line.length--;
+        return line;
+    }
+    write = cr;
+    while (cr) {
+        next = memchr(cr + 1, '\r', end - cr - 1);
+        if (!next) next = end;
+        memmove(write, cr + 1, next - cr - 1);
+        write += next - cr - 1;
+        cr = next < end ? next : NULL;
+    }
+    line.length = write - line.data;
+    return line;
+}
+
+/* Reads whatever is available, up to room bytes. With POSIX this is one
+ * read(2), so input from a pipe is parsed as it arrives instead of waiting
+ * for a whole block. Returns 0 at the end of the file or on an error. */
+static size_t file_read(FILE * file, uint8_t * data, size_t room) {
+#ifndef BKD_NO_POSIX
+    ssize_t n;
+    do {
+        n = read(fileno(file), data, room);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        BKD_ERROR(BKD_ERROR_IO);
+        return 0;
+    }
+    return (size_t) n;
+#else
+    return fread(data, 1, room, file);
+#endif
+}
+
+/* Reads the file into all the free room in the buffer, at least a block at a
+ * time, and hands out lines as views into the buffer. Only the unfinished
+ * line at the end of a chunk is moved. */
 static int file_getl(struct bkd_istream * in) {
     FILE * file = (FILE *) in->user;
-    int c;
-    in->buffer.string.length = 0; /* Clear the buffer */
-    for(;;) {
-        c = fgetc(file);
-        if(c == EOF) {
-            if (in->buffer.string.length == 0) {
+    struct bkd_buffer * buffer = &in->buffer;
+    uint32_t start = in->offset;
+    uint32_t scanned = start;
+    uint8_t * newline;
+    size_t n;
+    for (;;) {
+        newline = memchr(buffer->string.data + scanned, '\n', buffer->string.length - scanned);
+        if (newline)
+            break;
+        scanned = buffer->string.length;
+        /* Move the partial line to the front and read another block. */
+        if (start > 0) {
+            memmove(buffer->string.data, buffer->string.data + start, buffer->string.length - start);
+            buffer->string.length -= start;
+            scanned -= start;
+            start = 0;
+        }
+        /* Grow geometrically, so a long line is not copied once per block. */
+        if (buffer->capacity - buffer->string.length < BKD_FILE_BLOCKSIZE) {
+            uint64_t capacity = 2 * (uint64_t) buffer->capacity;
+            uint8_t * data;
+            if (capacity < (uint64_t) buffer->string.length + BKD_FILE_BLOCKSIZE)
+                capacity = (uint64_t) buffer->string.length + BKD_FILE_BLOCKSIZE;
+            if (capacity > UINT32_MAX || !(data = BKD_REALLOC(buffer->string.data, capacity))) {
+                BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
                 in->done = 1;
                 return 0;
-            } else
-                break;
+            }
+            buffer->string.data = data;
+            buffer->capacity = capacity;
         }
-        if (c == '\n')
-            break;
-        if (c != '\r')
-            in->buffer = bkd_bufpushb(in->buffer, c);
+        n = file_read(file, buffer->string.data + buffer->string.length,
+                buffer->capacity - buffer->string.length);
+        if (n == 0) {
+            /* The last line has no newline. */
+            in->offset = buffer->string.length;
+            in->line = strip_cr(bkd_strsub(buffer->string, start, -1));
+            if (in->line.length == 0) {
+                in->done = 1;
+                return 0;
+            }
+            return 1;
+        }
+        buffer->string.length += n;
     }
+    in->offset = newline - buffer->string.data + 1;
+    in->line.data = buffer->string.data + start;
+    in->line.length = newline - in->line.data;
+    in->line = strip_cr(in->line);
     return 1;
 }
 
@@ -164,11 +550,15 @@ static int stdin_getl(struct bkd_istream * in) {
 }
 
 static struct bkd_istreamdef _bkd_file_istreamdef = {
-    file_getl
+    file_getl,
+    NULL,
+    0
 };
 
 static struct bkd_istreamdef _bkd_stdin_istreamdef = {
-    stdin_getl
+    stdin_getl,
+    NULL,
+    0
 };
 
 static struct bkd_istream _bkd_stdin = {
@@ -177,6 +567,8 @@ static struct bkd_istream _bkd_stdin = {
     {
         0, {0, 0}
     },
+    {0, 0},
+    0,
     0
 };
 
@@ -196,4 +588,89 @@ struct bkd_ostream bkd_file_ostream(FILE * file) {
     return stream;
 }
 
+#ifndef BKD_NO_POSIX
+
+/* Memory mapped input stream */
+
+static void mmap_close(struct bkd_istream * in) {
+    struct memory_state * state = (struct memory_state *) in->user;
+    munmap(state->base, state->size);
+    BKD_FREE(state);
+    in->user = NULL;
+}
+
+/* Used when the file can't be mapped. The stream owns the FILE. */
+static void ownedfile_close(struct bkd_istream * in) {
+    fclose((FILE *) in->user);
+    in->user = NULL;
+}
+
+static struct bkd_istreamdef _bkd_mmap_istreamdef = {
+    memory_getl,
+    mmap_close,
+    BKD_ISTREAM_STABLE
+};
+
+static struct bkd_istreamdef _bkd_ownedfile_istreamdef = {
+    file_getl,
+    ownedfile_close,
+    0
+};
+
+/* Takes ownership of fd. */
+static struct bkd_istream * mmap_istream_init(struct bkd_istream * stream, int fd) {
+    struct stat st;
+    struct memory_state * state;
+    void * base;
+    FILE * file;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED) {
+            close(fd);
+            state = BKD_MALLOC(sizeof(struct memory_state));
+            if (!state) {
+                BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+                munmap(base, st.st_size);
+                return NULL;
+            }
+            state->base = base;
+            state->size = st.st_size;
+            state->pos = 0;
+#ifdef MADV_SEQUENTIAL
+            madvise(base, st.st_size, MADV_SEQUENTIAL);
+#endif
+            return bkd_istream_init(&_bkd_mmap_istreamdef, stream, state);
+        }
+    }
+    /* Pipes, empty files, and anything else that can't be mapped. */
+    file = fdopen(fd, "rb");
+    if (!file) {
+        close(fd);
+        BKD_ERROR(BKD_ERROR_IO);
+        return NULL;
+    }
+    return bkd_istream_init(&_bkd_ownedfile_istreamdef, stream, file);
+}
+
+struct bkd_istream * bkd_mmap_istream(struct bkd_istream * stream, const char * path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        BKD_ERROR(BKD_ERROR_IO);
+        return NULL;
+    }
+    return mmap_istream_init(stream, fd);
+}
+
+/* Does not take ownership of fd. */
+struct bkd_istream * bkd_mmap_istream_fd(struct bkd_istream * stream, int fd) {
+    int copy = dup(fd);
+    if (copy < 0) {
+        BKD_ERROR(BKD_ERROR_IO);
+        return NULL;
+    }
+    return mmap_istream_init(stream, copy);
+}
+
+#endif
+
 #endif
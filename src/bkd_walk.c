@@ -0,0 +1,131 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "bkd.h"
+
+#include <string.h>
+
+void bkd_walk_init(struct bkd_walk * walk, const struct bkd_node * items, uint32_t count) {
+    walk->root.node = NULL;
+    walk->root.line = NULL;
+    walk->root.items = items;
+    walk->root.lines = NULL;
+    walk->root.count = count;
+    walk->root.next = 0;
+    walk->stack = walk->frames;
+    walk->capacity = BKD_WALK_FRAMES;
+    walk->depth = 0;
+    walk->left = 0;
+    walk->error = 0;
+}
+
+void bkd_walk_free(struct bkd_walk * walk) {
+    if (walk->stack != walk->frames)
+        BKD_FREE(walk->stack);
+    walk->stack = walk->frames;
+    walk->capacity = BKD_WALK_FRAMES;
+}
+
+/* Doubles the stack, moving it to the heap the first time. */
+static int walk_grow(struct bkd_walk * walk) {
+    uint32_t capacity = 2 * walk->capacity;
+    struct bkd_walkframe * grown;
+    if (walk->stack != walk->frames) {
+        grown = BKD_REALLOC(walk->stack, capacity * sizeof(struct bkd_walkframe));
+    } else if ((grown = BKD_MALLOC(capacity * sizeof(struct bkd_walkframe)))) {
+        memcpy(grown, walk->frames, sizeof(walk->frames));
+    }
+    if (!grown) {
+        BKD_ERROR(BKD_ERROR_OUT_OF_MEMORY);
+        walk->error = BKD_ERROR_OUT_OF_MEMORY;
+        return 0;
+    }
+    walk->stack = grown;
+    walk->capacity = capacity;
+    return 1;
+}
+
+/* Fills in a frame for a block node. The text of paragraphs, headers,
+ * comments and plain text is its only child. */
+static void walk_block(struct bkd_walkframe * f, const struct bkd_node * node) {
+    f->node = node;
+    f->line = NULL;
+    f->lines = NULL;
+    f->count = 0;
+    switch (node->type) {
+        case BKD_PARAGRAPH: f->lines = &node->data.paragraph.text; break;
+        case BKD_HEADER: f->lines = &node->data.header.text; break;
+        case BKD_COMMENTBLOCK: f->lines = &node->data.commentblock.text; break;
+        case BKD_TEXT: f->lines = &node->data.text; break;
+        case BKD_LIST:
+            f->items = node->data.list.items;
+            f->count = node->data.list.itemCount;
+            break;
+        case BKD_TABLE:
+            f->items = node->data.table.items;
+            f->count = node->data.table.itemCount;
+            break;
+        default:
+            break;
+    }
+    if (f->lines)
+        f->count = 1;
+}
+
+int bkd_walk_next(struct bkd_walk * walk) {
+    struct bkd_walkframe * parent, * f;
+    if (walk->error)
+        return 0;
+    if (walk->left) {
+        walk->depth--;
+        walk->left = 0;
+    }
+    parent = walk->depth ? walk->stack + walk->depth - 1 : &walk->root;
+    if (parent->next == parent->count) {
+        if (!walk->depth)
+            return 0;
+        walk->left = 1;
+        return BKD_WALK_LEAVE;
+    }
+    if (walk->depth == walk->capacity) {
+        if (!walk_grow(walk))
+            return 0;
+        parent = walk->stack + walk->depth - 1;
+    }
+    f = walk->stack + walk->depth++;
+    f->index = parent->next++;
+    f->next = 0;
+    f->items = NULL;
+    if (parent->lines) {
+        f->node = NULL;
+        f->line = parent->lines + f->index;
+        f->lines = f->line->nodeCount ? f->line->tree.node : NULL;
+        f->count = f->line->nodeCount;
+    } else {
+        walk_block(f, parent->items + f->index);
+    }
+    /* A node without children is left right away */
+    if (!f->count) {
+        walk->left = 1;
+        return BKD_WALK_ENTER | BKD_WALK_LEAVE;
+    }
+    return BKD_WALK_ENTER;
+}
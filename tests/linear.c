@@ -0,0 +1,217 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Checks that parsing and rendering take linear time on hostile input.
+ * Every case is built at two sizes, and the time per input byte of the
+ * larger one may not grow by more than LINEAR_MAXRATIO. The built in corpus
+ * repeats patterns that once made some path rescan the same bytes, and the
+ * fuzz cases repeat random snippets of markup characters. Usage:
+ *
+ *     tests/linear [seed [fuzzcases]]
+ */
+
+#include "bkd.h"
+#include "bkd_html.h"
+#include "bkd_string.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Input sizes. A quadratic path is LINEAR_GROWTH times slower per byte
+ * on the larger input, a linear one about as fast. */
+#define LINEAR_SMALL (64 * 1024)
+#define LINEAR_GROWTH 8
+#define LINEAR_MAXRATIO 2.5
+
+/* Each measurement repeats until it has run at least this long. */
+#define LINEAR_MINTIME 0.02
+
+struct pattern {
+    const char * name;
+    const char * prefix;
+    const char * unit;
+    const char * suffix;
+};
+
+static const struct pattern corpus[] = {
+    {"esc_paren", "", "\\(", "\n"},
+    {"esc_paren_br", "", "\\([", "\n"},
+    {"esc_open", "\\(", "[a", "\n"},
+    {"open_esc", "", "[a", "\\(\n"},
+    {"open", "", "[", "\n"},
+    {"open_close", "", "[B:a]", "\n"},
+    {"open_data", "", "[", "](\n"},
+    {"close", "[a", "]", "\n"},
+    {"close_paren", "[B:a", "](", "\n"},
+    {"data_open", "", "[a](", "\n"},
+    {"data_noclose", "", "[a](b", "\n"},
+    {"deep_close", "", "[B:", "]\n"},
+    {"open_bs", "", "[\\", "\n"},
+    {"backslash", "", "\\", "\n"},
+    {"pipe", "", "|", "\n"},
+    {"pipe_cell", "", "| a ", "\n"},
+    {"pipe_open", "", "|[", "\n"},
+    {"pipe_esc", "", "|\\(", "\n"},
+    {"pipe_data", "", "|[a](", "\n"},
+    {"pipe_rows", "", "| a | b |\n", ""},
+    {"bs_lines", "", "a\\\n", ""},
+    {"code_lines", "```\n", "x\n", ""},
+    {"comment", "", "> a\n", ""},
+    {"list_lines", "", "* a\n", ""},
+    {"list_nested", "", "* * a\n", ""},
+    {"header", "", "# a\n", ""},
+    {"rule", "", "---\n", ""},
+    {"paragraphs", "", "a\n\n", ""},
+    {"indented", "", "    a\n\n", ""},
+    {"bad_utf8", "", "\xff", "\n"},
+};
+
+/* Small deterministic generator, so failures can be reproduced by seed. */
+static uint32_t seed = 12345;
+
+static uint32_t linear_rand(uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+static double now(void) {
+    return (double) clock() / CLOCKS_PER_SEC;
+}
+
+/* Builds prefix, then unit until the input is at least size bytes, then suffix. */
+static char * build(const struct pattern * p, size_t size, size_t * length) {
+    size_t prefix = strlen(p->prefix), unit = strlen(p->unit), suffix = strlen(p->suffix);
+    size_t count = (size + unit - 1) / unit;
+    char * data = malloc(prefix + count * unit + suffix);
+    char * at = data;
+    memcpy(at, p->prefix, prefix);
+    at += prefix;
+    for (size_t i = 0; i < count; i++, at += unit)
+        memcpy(at, p->unit, unit);
+    memcpy(at, p->suffix, suffix);
+    *length = prefix + count * unit + suffix;
+    return data;
+}
+
+/* Parses and renders the input, and returns the time it takes per byte in
+ * nanoseconds, the best of a few runs. */
+static double per_byte(const char * data, size_t length) {
+    struct bkd_ostream out = bkd_string_ostream();
+    struct bkd_list * document;
+    double best = 0, start, elapsed;
+    uint32_t runs;
+    for (int i = 0; i < 3; i++) {
+        runs = 0;
+        start = now();
+        do {
+            document = bkd_parse_buffer((const uint8_t *) data, length);
+            bkd_html(&out, document, 0, 0, NULL);
+            bkd_strfree(bkd_string_ostream_take(&out));
+            bkd_docfree(document);
+            runs++;
+        } while ((elapsed = now() - start) < LINEAR_MINTIME);
+        elapsed /= runs;
+        if (i == 0 || elapsed < best)
+            best = elapsed;
+    }
+    bkd_ostream_close(&out);
+    return best * 1e9 / length;
+}
+
+/* Returns 1 if the pattern stays linear. */
+static int check(const struct pattern * p) {
+    size_t smallLength, largeLength;
+    char * small = build(p, LINEAR_SMALL, &smallLength);
+    char * large = build(p, LINEAR_SMALL * LINEAR_GROWTH, &largeLength);
+    double smallTime = per_byte(small, smallLength);
+    double largeTime = per_byte(large, largeLength);
+    double ratio = largeTime / smallTime;
+    int ok = ratio <= LINEAR_MAXRATIO;
+    printf("linear %-14s %8.2f ns/B %8.2f ns/B  x%.2f%s\n",
+            p->name, smallTime, largeTime, ratio, ok ? "" : "  FAIL");
+    free(small);
+    free(large);
+    return ok;
+}
+
+/* Makes a random pattern out of the characters that mean something to
+ * the parser. Names and snippets live in static storage. */
+static struct pattern fuzz_pattern(uint32_t index) {
+    static const char alphabet[] = "[[]]()\\|:*#-`>%. aB(\n";
+    static const char * prefixes[] = {"", "", "", "| ", "* ", "> ", "```\n", "    "};
+    static char name[32];
+    static char unit[17];
+    struct pattern p;
+    uint32_t length = 1 + linear_rand(sizeof(unit) - 1);
+    for (uint32_t i = 0; i < length; i++)
+        unit[i] = alphabet[linear_rand(sizeof(alphabet) - 1)];
+    unit[length] = '\0';
+    snprintf(name, sizeof(name), "fuzz%u", index);
+    p.name = name;
+    p.prefix = prefixes[linear_rand(sizeof(prefixes) / sizeof(*prefixes))];
+    p.unit = unit;
+    p.suffix = "\n";
+    return p;
+}
+
+static void print_quoted(const char * string) {
+    putchar('"');
+    for (; *string; string++) {
+        if (*string == '\n')
+            fputs("\\n", stdout);
+        else if (*string == '\\' || *string == '"')
+            printf("\\%c", *string);
+        else
+            putchar(*string);
+    }
+    putchar('"');
+}
+
+int main(int argc, char ** argv) {
+    uint32_t fuzzCases = 32, failed = 0, i;
+    struct pattern p;
+    if (argc > 1)
+        seed = (uint32_t) strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        fuzzCases = (uint32_t) strtoul(argv[2], NULL, 10);
+    printf("linear seed %u\n", seed);
+    for (i = 0; i < sizeof(corpus) / sizeof(*corpus); i++)
+        failed += !check(corpus + i);
+    for (i = 0; i < fuzzCases; i++) {
+        p = fuzz_pattern(i);
+        if (!check(&p)) {
+            failed++;
+            printf("    prefix ");
+            print_quoted(p.prefix);
+            printf(" unit ");
+            print_quoted(p.unit);
+            printf("\n");
+        }
+    }
+    if (failed) {
+        printf("linear: %u superlinear case%s\n", failed, failed == 1 ? "" : "s");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Checks that bkd --stream writes a block before its input ends. A slow
+# writer sends one block into a pipe, then waits for its HTML to show up
+# in the output before it sends the rest. Usage:
+#
+#     tests/pipe.sh [bkd]
+
+BKD=${1:-./bkd}
+OUT=${TMPDIR:-/tmp}/bkd-pipe.$$
+SEEN=$OUT.seen
+trap 'rm -f "$OUT" "$SEEN"' EXIT
+
+{
+    printf '# First\n\nhello\n\n'
+    tries=0
+    while [ $tries -lt 50 ]; do
+        if grep -q '<p>hello</p>' "$OUT" 2>/dev/null; then
+            : > "$SEEN"
+            break
+        fi
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+    printf 'the end\n'
+} | "$BKD" --stream > "$OUT"
+
+if [ ! -f "$SEEN" ]; then
+    echo "pipe: no output before the input ended"
+    exit 1
+fi
+if ! grep -q 'the end' "$OUT"; then
+    echo "pipe: the rest of the input is missing"
+    exit 1
+fi
+echo "pipe: output started before the input ended"
@@ -0,0 +1,259 @@
+/*
+Copyright (c) 2016 Calvin Rose
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+/*
+ * Checks the push parser and the event parser against bkd_parse. Each input
+ * is fed to bkd_parser_feed in chunks of fixed small sizes and of random
+ * sizes, and must render to the same HTML as the whole buffer does. Its
+ * events must nest: every open is closed, markup closes in the reverse order
+ * it opened, text only comes inside a block, and there is one top level open
+ * for each node bkd_parse finds. Inputs are the files given on the command
+ * line and a number of random snippets of markup characters. Usage:
+ *
+ *     tests/stream [-s seed] [-n fuzzcases] [file...]
+ */
+
+#include "bkd.h"
+#include "bkd_html.h"
+#include "bkd_string.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STREAM_MAXDEPTH 256
+#define STREAM_RANDOMFEEDS 8
+
+/* Small deterministic generator, so failures can be reproduced by seed. */
+static uint32_t seed = 12345;
+
+static uint32_t stream_rand(uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+/* Renders and frees a document. A failed parse renders as nothing. */
+static struct bkd_string render(struct bkd_list * document) {
+    struct bkd_ostream out;
+    struct bkd_string html;
+    if (!document)
+        return BKD_NULLSTR;
+    out = bkd_string_ostream();
+    bkd_html(&out, document, 0, 0, NULL);
+    html = bkd_string_ostream_take(&out);
+    bkd_ostream_close(&out);
+    bkd_docfree(document);
+    return html;
+}
+
+/* Feeds the input in chunks of size bytes, or of random sizes up to 64
+ * bytes when size is 0. */
+static struct bkd_string render_fed(struct bkd_string input, uint32_t size) {
+    struct bkd_parser * parser = bkd_parser_new();
+    uint32_t at = 0, n;
+    while (at < input.length) {
+        n = size ? size : 1 + stream_rand(64);
+        if (n > input.length - at)
+            n = input.length - at;
+        if (bkd_parser_feed(parser, input.data + at, n))
+            break;
+        at += n;
+    }
+    return render(bkd_parser_finish(parser));
+}
+
+/* Tracks the events of one parse. */
+struct balance {
+    uint32_t blocks[STREAM_MAXDEPTH];
+    uint32_t blockDepth;
+    uint32_t markups[STREAM_MAXDEPTH];
+    uint32_t markupDepth;
+    uint32_t topLevel;
+    const char * error;
+};
+
+static void on_open(void * user, const struct bkd_node * node) {
+    struct balance * b = (struct balance *) user;
+    if (b->markupDepth)
+        b->error = "block opened inside markup";
+    else if (b->blockDepth == STREAM_MAXDEPTH)
+        b->error = "blocks nest too deep";
+    else {
+        b->topLevel += b->blockDepth == 0;
+        b->blocks[b->blockDepth++] = node->type;
+    }
+}
+
+static void on_close(void * user, const struct bkd_node * node) {
+    struct balance * b = (struct balance *) user;
+    if (b->markupDepth)
+        b->error = "block closed inside markup";
+    else if (b->blockDepth == 0)
+        b->error = "close without open";
+    else if (b->blocks[--b->blockDepth] != node->type)
+        b->error = "close does not match open";
+}
+
+static void on_markup_open(void * user, uint32_t markup, struct bkd_string data) {
+    struct balance * b = (struct balance *) user;
+    (void) data;
+    if (b->blockDepth == 0)
+        b->error = "markup outside a block";
+    else if (b->markupDepth == STREAM_MAXDEPTH)
+        b->error = "markup nests too deep";
+    else
+        b->markups[b->markupDepth++] = markup;
+}
+
+static void on_markup_close(void * user, uint32_t markup, struct bkd_string data) {
+    struct balance * b = (struct balance *) user;
+    (void) data;
+    if (b->markupDepth == 0)
+        b->error = "markup close without open";
+    else if (b->markups[--b->markupDepth] != markup)
+        b->error = "markup close does not match open";
+}
+
+static void on_text(void * user, struct bkd_string text) {
+    struct balance * b = (struct balance *) user;
+    (void) text;
+    if (b->blockDepth == 0)
+        b->error = "text outside a block";
+}
+
+/* Returns NULL if the events of input nest, or what went wrong. */
+static const char * check_events(struct bkd_string input, uint32_t topLevel) {
+    struct bkd_istream in = bkd_string_istream(input);
+    struct balance b;
+    struct bkd_handler handler = {&b, on_open, on_close, on_markup_open, on_markup_close, on_text};
+    int error;
+    memset(&b, 0, sizeof(b));
+    error = bkd_parse_events(&in, &handler);
+    bkd_istream_close(&in);
+    if (error)
+        return "parse error";
+    if (b.error)
+        return b.error;
+    if (b.blockDepth || b.markupDepth)
+        return "open at the end";
+    if (b.topLevel != topLevel)
+        return "top level count differs from bkd_parse";
+    return NULL;
+}
+
+/* Returns 1 if every way of parsing input agrees. */
+static int check(const char * name, struct bkd_string input) {
+    static const uint32_t sizes[] = {1, 2, 3, 5, 7, 16, 4096};
+    struct bkd_list * document = bkd_parse_buffer(input.data, input.length);
+    uint32_t topLevel = document->itemCount;
+    struct bkd_string expected = render(document), html;
+    const char * error;
+    int ok = 1;
+    uint32_t i;
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes) + STREAM_RANDOMFEEDS; i++) {
+        uint32_t size = i < sizeof(sizes) / sizeof(*sizes) ? sizes[i] : 0;
+        html = render_fed(input, size);
+        if (!bkd_strequal(html, expected)) {
+            if (size)
+                printf("stream %s: fed %u bytes at a time, output differs\n", name, size);
+            else
+                printf("stream %s: fed random chunks, output differs\n", name);
+            ok = 0;
+        }
+        bkd_strfree(html);
+    }
+    if ((error = check_events(input, topLevel))) {
+        printf("stream %s: events: %s\n", name, error);
+        ok = 0;
+    }
+    bkd_strfree(expected);
+    return ok;
+}
+
+static int check_file(const char * path) {
+    FILE * file = fopen(path, "rb");
+    struct bkd_string input;
+    long size;
+    int ok;
+    if (!file || fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0) {
+        printf("stream %s: cannot read\n", path);
+        if (file)
+            fclose(file);
+        return 0;
+    }
+    rewind(file);
+    input.data = malloc(size ? size : 1);
+    input.length = (uint32_t) fread(input.data, 1, size, file);
+    fclose(file);
+    ok = check(path, input);
+    free(input.data);
+    return ok;
+}
+
+/* Random lines of markup characters and multibyte text, so chunks split
+ * lines, tokens and UTF-8 sequences in many places. */
+static int check_fuzz(uint32_t index) {
+    static const char * pieces[] = {
+        "[", "]", "(", ")", "\\", "|", ":", "*", "#", "-", "`", ">", "%", ".",
+        " ", "  ", "a", "B", "\n", "\n\n", "* ", "1. ", "| ", "```\n", "    ",
+        "\xc3\xa9", "\xe6\x97\xa5\xe6\x9c\xac", "\xf0\x9f\x99\x82", "\r\n"
+    };
+    uint8_t data[2048];
+    char name[32];
+    uint32_t length = 0, piece;
+    size_t n;
+    while (length < sizeof(data) - 8) {
+        piece = stream_rand(sizeof(pieces) / sizeof(*pieces));
+        n = strlen(pieces[piece]);
+        memcpy(data + length, pieces[piece], n);
+        length += n;
+        if (stream_rand(256) == 0)
+            break;
+    }
+    snprintf(name, sizeof(name), "fuzz%u", index);
+    return check(name, (struct bkd_string) {length, data});
+}
+
+int main(int argc, char ** argv) {
+    uint32_t fuzzCases = 64, cases = 0, failed = 0, i;
+    int arg;
+    for (arg = 1; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "-s") && arg + 1 < argc)
+            seed = (uint32_t) strtoul(argv[++arg], NULL, 10);
+        else if (!strcmp(argv[arg], "-n") && arg + 1 < argc)
+            fuzzCases = (uint32_t) strtoul(argv[++arg], NULL, 10);
+    }
+    printf("stream seed %u\n", seed);
+    for (arg = 1; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "-s") || !strcmp(argv[arg], "-n")) {
+            arg++;
+            continue;
+        }
+        failed += !check_file(argv[arg]);
+        cases++;
+    }
+    for (i = 0; i < fuzzCases; i++)
+        failed += !check_fuzz(i);
+    cases += fuzzCases;
+    printf("stream %u of %u inputs agree\n", cases - failed, cases);
+    return failed ? 1 : 0;
+}